@@ -7,13 +7,17 @@
 
 #define CASv(var, old, new) __sync_bool_compare_and_swap(&(var), old, new)
 #define CASp(ptr, old, new) __sync_bool_compare_and_swap(ptr, old, new)
+#define CAS(var, old, new)  __sync_bool_compare_and_swap(&(var), old, new) //usable as an expression, true if swapped
 #define INCR(var) __sync_add_and_fetch(&(var), 1)
+#define ADD(var, val) __sync_add_and_fetch(&(var), val)
 
 #else
 
 #define CASv(var, old, new) if((var) == (old)) { (var) = (new); }
 #define CASp(ptr, old, new) if(*(ptr) == (old)) { *(ptr) = (new); }
+#define CAS(var, old, new)  ((var) == (old) ? ((var) = (new), true) : false)
 #define INCR(var) (++(var))
+#define ADD(var, val) ((var) += (val))
 
 /*
 template <class T> void CASv(T& var, const T& old, const T& val) {
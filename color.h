@@ -131,5 +131,21 @@ HSV::HSV(RGB rgb){
 	}
 }
 
+//hue for a grain orientation, folded by the cubic symmetry so equivalent orientations get the same colour
+double directional_hue(double theta1, double phi){
+	double vec[3];
+	vec[0] = fabs(sin(phi)*sin(theta1));
+	vec[1] = fabs(cos(theta1)*sin(phi));
+	vec[2] = fabs(cos(phi));
+
+	sort(vec, vec+3);
+
+	vec[0] /= vec[2];
+	vec[1] /= vec[2];
+	vec[2] /= vec[2];
+
+	return HSV(RGB(vec[0], vec[1] - vec[0], vec[2] - vec[1])).h;
+}
+
 #endif
 
@@ -1,70 +1,8 @@
 
-#include <vector>
-#include <cstdlib>
-#include <cstdio>
-#include <cstring>
-#include <unistd.h>
-#include <stdint.h>
-#include <cmath>
-#include <time.h>
-#include <sys/time.h>
-#include <signal.h>
-#include <cstdarg>
-#include "gd.h"
-#include <pthread.h>
-#include <queue>
-#include <algorithm>
-
-using namespace std;
-
-//some compile time options
-#ifndef FIELD
-#define FIELD (1<<10) //1024, size of the grid
-#endif
-
-#ifndef MAX_THREADS
-#define MAX_THREADS 100 //slight speed improvement by setting to 1
-#endif
+#include "polycrystal.h"
 
-struct Options {
-	bool cmdline;   // output the command line that was used
-	bool console;   // output the console output to a file too
-	bool timestats; // output time stats
-	bool layerstats;// output layer stats
-	bool slopemap;  // map of slopes, easiest visualization
-	bool isomorphic;// isomorphic visualization
-	bool heightmap; // map of heights
-	bool heightdump;// dump of heights, may be possible to turn into a 3d model
-	bool timemap;   // map of grains as a top down view, may be useful for stats?
-	bool fluxdump;  // dump of amount of flux received per x,y coord
-	bool peaks;     // dump of the active peaks per timestep: id,x,y,z
-	bool layermap;  // map of grains of a layer, may be useful for stats?
-	bool voronei;   // voronei diagram of initial grain placements
-	bool graininit; // output the initial grain placements
-	bool growth;    // dump of growth of each grain/face
-	bool datadump;  // full grid data dump, could be read after the fact to generate any stats needed
-	bool savemem;   // dump the data grid temporarily to save memory
-	bool pockets;   // mark and drop pockets, potentially save more memory and get better data dumps
-	bool interrupt; // set by the interrupt handler, meaning finish your current iteration then exit
-	bool randcolor; // use random colours instead of directional colours
-} opts;
-
-inline void echo(const char *format, ...){
-	char buffer[1024];
-
-	va_list args;
-	va_start(args, format);
-	vsnprintf(buffer, sizeof(buffer)-1, format, args);
-	va_end(args);
-
-	printf("%s", buffer);
-	
-	if(opts.console){
-		FILE *fd = fopen("console.txt", "a");
-		fprintf(fd, "%s", buffer);
-		fclose(fd);
-	}
-}
+#include <sched.h>
+#include <sys/stat.h>
 
 void interrupt(int sig){
 	if(opts.interrupt){
@@ -74,56 +12,8 @@ void interrupt(int sig){
 	opts.interrupt = true;
 }
 
-#include "shapes.h"
-#include "grain.cpp"
-#include "grid.cpp"
-#include "growth.cpp"
-
-int main(int argc, char **argv){
-	srand(time(NULL));
-
-	signal(SIGINT,  interrupt);
-	signal(SIGTERM, interrupt);
-
-	opts.cmdline   = true;
-	opts.console   = true;
-	opts.layerstats= true;
-	opts.timestats = true;
-	opts.layermap  = true;
-	opts.slopemap  = true;
-	opts.isomorphic= false;
-	opts.heightmap = false;
-	opts.heightdump= false;
-	opts.timemap   = false;
-	opts.fluxdump  = false;
-	opts.peaks     = false;
-	opts.voronei   = false;
-	opts.graininit = false;
-	opts.datadump  = false;
-	opts.savemem   = false;
-	opts.pockets   = false;
-	opts.interrupt = false;
-	opts.randcolor = false;
-
-	char * dir        = NULL;
-	int    max_memory = 0;
-	int    threads    = min(5, MAX_THREADS);
-
-	bool   load_data  = false;
-	int    num_steps  = 200;
-	double growth_factor = 1.0;
-	double start_angle = 0.0;
-	int    num_grains = 10000;
-	int    end_grains = 20;
-	double min_dist   = 0.0;
-	double ray_angle  = 0;
-	double ray_cutoff = 85;
-	int    ray_step   = 10;
-	double ray_ratio  = 1.0;
-	double diffusion  = 0;
-	bool   substrate_diffusion = true;
-	int    shape_id   = 6;
-
+//read the arguments into c, and the output options into opts
+void parse_args(int argc, char **argv, Config & c){
 	for(int i = 1; i < argc; i++){
 		char * ptr = argv[i];
 		if(strcmp(ptr, "-h") == 0 || strcmp(ptr, "--help") == 0){
@@ -136,16 +26,27 @@ int main(int argc, char **argv){
 				"\t-m --memory     Maximum memory usage in Mb [unlimited]\n",
 				argv[0], argv[0]);
 #if MAX_THREADS > 1
-		printf(	"\t-t --threads    Number of worker threads [%d]\n", threads);
+		printf(	"\t-t --threads    Number of worker threads [%d]\n", c.threads);
+		printf(	"\t   --numa       Pin the threads to NUMA nodes, each growing a band of rows in its own memory\n");
 #endif
+		printf(	"\t   --batch      Make one run per line of this file, each line's options added to these, in one process\n"
+				"\t                Grain placements are shared, and each run writes to its own -d under this -d [run.%%03d]\n"
+				"\t   --jobs       Number of batch runs to make at once, each with its own threads [%d]\n", c.jobs);
+		printf(	"\t   --slabs      Split the field into this many slabs of rows, each grown by its own process [%d]\n"
+				"\t                Only timestats, growth, heightdump and graininit are output, no diffusion or horizon\n",
+				c.num_slabs);
 		printf(	"\nOutput Options:\n"
 				"\t   --cmdline    Output the command line                to cmdline.txt     - on\n"
 				"\t   --console    Copy the console output                to console.txt     - on\n"
 				"\t   --timestats  Output stats per timestep              to timestats.csv   - on\n"
 				"\t   --layerstats Output stats per layer                 to layerstats.csv  - on\n"
 				"\t   --layermap   Output a layer  map  for each layer    to layer.%%05d.png  - on\n"
+				"\t   --grainstats Output grain sizes and boundaries for each layer to layergrains.%%05d.csv,\n"
+				"\t                grainsizes.csv and boundaries.csv                         - off\n"
 				"\t   --slopemap   Output a slope  map  for each timestep to slope.%%05d.png  - on\n"
 				"\t   --surf3d     Output a surf3d map  for each timestep to surf3d.%%05d.png - off\n"
+				"\t   --perspective Render the surf3d map in perspective, not isometric      - off\n"
+				"\t   --iso3d      Output a voxel 3d map for each timestep to isomorphic.%%05d.png - off\n"
 				"\t   --timemap    Output a time   map  for each timestep to time.%%05d.png   - off\n"
 				"\t   --heightmap  Output a height map  for each timestep to height.%%05d.png - off\n"
 				"\t   --heightdump Output a height dump for each timestep to height.%%05d.dat - off\n"
@@ -153,9 +54,13 @@ int main(int argc, char **argv){
 				"\t   --datadump   Output a binary dump for each layer    to data.%%05d.dat   - off\n"
 				"\t   --growth     Output a growth list for each timestep to growth.%%05d.csv - off\n"
 				"\t   --peaks      Output a peaks  list for each timestep to peaks.%%05d.csv  - off\n"
+				"\t   --tracks     Output how each peak moved since the last timestep to tracks.csv - off\n"
+				"\t   --psd        Output a power spectrum for each timestep to psd.%%05d.csv, psdstats.csv - off\n"
+				"\t   --events     Output each grain buried or back on the surface, and by whom, to events.csv - off\n"
+				"\t   --texture    Output surface grain orientations for each timestep to texture.csv, pole.%%05d.csv - off\n"
 				"\t   --graininit  Output initial grain placements        to grains.csv      - off\n"
 				"\t   --voronei    Output a voronei map of initial grains to voronei.png     - off\n"
-				"\t   --pockets    Mark pockets in datadump, saves memory with --savemem     - off\n"
+				"\t   --pockets    Mark pockets as they close, saves memory with --savemem   - off\n"
 				"\t   --savemem    Dump the data to disk (temporarily) to save memory        - off\n"
 				"\t   --randcolor  Use random grain coloring, not directional coloring       - off\n"
 				"\t   --dataformat Output a description of the binary format\n"
@@ -170,15 +75,21 @@ int main(int argc, char **argv){
 				"\t-S --startangle Angle constant to center the grain rotation distribution around [%.2f]\n"
 				"\t   --sep        Minimum grain separation [auto]\n"
 				"\t-f --factor     Growth Factor (0,1], can slow down the sim for greater accuracy [%.2f]\n"
+				"\t   --adaptive   Size each step so no face advances more than this many points, growing as far as\n"
+				"\t                --steps of --factor would, with --factor the biggest step. Writes steps.csv [off]\n"
 				"\t-r --raystep    Step to start using ray tracing to add flux, 0 to disable rays [%d]\n"
 				"\t-R --rayratio   Number of rays to generate per occupied point [%.2f]\n"
 				"\t-a --angleconst Angle constant to center the ray distribution around (evap: 50+, sputter: 1-2, lpcvd: 0) [%.2f]\n"
 				"\t-c --cutoff     Cutoff angle for rays as measured from vertical, anything bigger is ignored [%.1f]\n"
 				"\t-D --diffusion  Probability of each diffusion step [0,1), only useful with raytracing [%.2f]\n"
-				"\t   --no-subdiff Turn off substrate diffusion, shoot extra rays until they hit a grain\n"
+				"\t   --no-subdiff Turn off substrate diffusion, rays landing on bare substrate are dropped and the rest scaled up\n"
+				"\t   --diffwalk   Diffusion along faces, random: step by step, face: jump the net distance [random]\n"
+				"\t   --horizon    Deterministic flux from horizon sweeps of the height field instead of rays, no diffusion\n"
+				"\t   --sobol      Spread the rays with a randomly shifted Sobol sequence, less noise so fewer rays are needed\n"
+				"\t   --jumprays   Jump rays through open space by the distance to the nearest threat, pays off with wide gaps\n"
 				"\t-s --shape      Shape (4,5,6,7,8,9,12,13,14,20,26,252) [%d]\n"
 				"\t   --shapes     List the available shapes\n",
-				num_steps, num_grains, end_grains, start_angle, growth_factor, ray_step, ray_ratio, ray_angle, ray_cutoff, diffusion, shape_id);
+				c.num_steps, c.num_grains, c.end_grains, c.start_angle, c.growth_factor, c.ray_step, c.ray_ratio, c.ray_angle, c.ray_cutoff, c.diffusion, c.shape_id);
 			exit(255);
 		} else if(strcmp(ptr, "--shapes") == 0){
 			printf("List of chooseable shapes\n"
@@ -197,34 +108,54 @@ int main(int argc, char **argv){
 			);
 			exit(255);
 		} else if(strcmp(ptr, "-d") == 0 || strcmp(ptr, "--dir") == 0) {
-			dir = argv[++i];
-			if(dir == NULL) { printf("Please specify output directory\n"); exit(1); }
+			c.dir = argv[++i];
+			if(c.dir == NULL) { printf("Please specify output directory\n"); exit(1); }
 		} else if(strcmp(ptr, "-z") == 0 || strcmp(ptr, "--message") == 0) {
 			ptr = argv[++i]; //ignore the next argument
 			opts.cmdline = true;
 		} else if(strcmp(ptr, "-t") == 0 || strcmp(ptr, "--threads") == 0) {
 			ptr = argv[++i];
 			if(ptr == NULL) { printf("Please specify Maximum thread count\n"); exit(1); }
-			threads = atoi(ptr);
-			if(threads < 1 || threads > MAX_THREADS){ printf("Thread count out of range, max: %d\n", MAX_THREADS); exit(1); }
+			c.threads = atoi(ptr);
+			if(c.threads < 1 || c.threads > MAX_THREADS){ printf("Thread count out of range, max: %d\n", MAX_THREADS); exit(1); }
+		} else if(strcmp(ptr, "--batch") == 0) {
+			c.batch = argv[++i];
+			if(c.batch == NULL) { printf("Please specify the batch file\n"); exit(1); }
+		} else if(strcmp(ptr, "--jobs") == 0) {
+			ptr = argv[++i];
+			if(ptr == NULL) { printf("Please specify the number of jobs\n"); exit(1); }
+			c.jobs = atoi(ptr);
+			if(c.jobs < 1 || c.jobs > MAX_THREADS){ printf("Job count out of range, max: %d\n", MAX_THREADS); exit(1); }
+		} else if(strcmp(ptr, "--numa") == 0) {
+			c.numa = true;
+		} else if(strcmp(ptr, "--slabs") == 0) {
+			ptr = argv[++i];
+			if(ptr == NULL) { printf("Please specify the number of slabs\n"); exit(1); }
+			c.num_slabs = atoi(ptr);
+			if(c.num_slabs < 1 || c.num_slabs > FIELD/SECTOR_H){ printf("Slab count out of range, max: %d\n", FIELD/SECTOR_H); exit(1); }
 		} else if(strcmp(ptr, "-m") == 0 || strcmp(ptr, "--memory") == 0) {
 			ptr = argv[++i];
 			if(ptr == NULL) { printf("Please specify Maximum memory\n"); exit(1); }
-			max_memory = atoi(ptr);
-			if(max_memory < 1){ printf("Max memory out of range\n"); exit(1); }
+			c.max_memory = atoi(ptr);
+			if(c.max_memory < 1){ printf("Max memory out of range\n"); exit(1); }
 		} else if(strcmp(ptr, "-v") == 0 || strcmp(ptr, "--verbose") == 0) {
 			opts.cmdline   = true;
 			opts.console   = true;
 			opts.layerstats= true;
 			opts.timestats = true;
 			opts.slopemap  = true;
-			opts.isomorphic= true;
+			opts.surf3d    = true;
 			opts.heightmap = true;
 			opts.heightdump= true;
 			opts.timemap   = true;
 			opts.fluxdump  = true;
 			opts.peaks     = true;
+			opts.tracks    = true;
+			opts.psd       = true;
+			opts.texture   = true;
+			opts.events    = true;
 			opts.layermap  = true;
+			opts.grainstats= true;
 			opts.voronei   = true;
 			opts.graininit = true;
 			opts.growth    = true;
@@ -238,12 +169,18 @@ int main(int argc, char **argv){
 			opts.timestats = false;
 			opts.slopemap  = false;
 			opts.isomorphic= false;
+			opts.surf3d    = false;
 			opts.heightmap = false;
 			opts.heightdump= false;
 			opts.timemap   = false;
 			opts.fluxdump  = false;
 			opts.peaks     = false;
+			opts.tracks    = false;
+			opts.psd       = false;
+			opts.texture   = false;
+			opts.events    = false;
 			opts.layermap  = false;
+			opts.grainstats= false;
 			opts.voronei   = false;
 			opts.graininit = false;
 			opts.growth    = false;
@@ -264,6 +201,10 @@ int main(int argc, char **argv){
 		} else if(strcmp(ptr, "--slopemap") == 0) {
 			opts.slopemap = true;
 		} else if(strcmp(ptr, "--surf3d") == 0) {
+			opts.surf3d = true;
+		} else if(strcmp(ptr, "--perspective") == 0) {
+			opts.perspective = true;
+		} else if(strcmp(ptr, "--iso3d") == 0) {
 			opts.isomorphic = true;
 		} else if(strcmp(ptr, "--heightmap") == 0) {
 			opts.heightmap = true;
@@ -275,8 +216,18 @@ int main(int argc, char **argv){
 			opts.fluxdump = true;
 		} else if(strcmp(ptr, "--peaks") == 0) {
 			opts.peaks = true;
+		} else if(strcmp(ptr, "--tracks") == 0) {
+			opts.tracks = true;
+		} else if(strcmp(ptr, "--psd") == 0) {
+			opts.psd = true;
+		} else if(strcmp(ptr, "--events") == 0) {
+			opts.events = true;
+		} else if(strcmp(ptr, "--texture") == 0) {
+			opts.texture = true;
 		} else if(strcmp(ptr, "--layermap") == 0) {
 			opts.layermap = true;
+		} else if(strcmp(ptr, "--grainstats") == 0) {
+			opts.grainstats = true;
 		} else if(strcmp(ptr, "--voronei") == 0) {
 			opts.voronei = true;
 		} else if(strcmp(ptr, "--graininit") == 0) {
@@ -293,7 +244,7 @@ int main(int argc, char **argv){
 			opts.randcolor = true;
 		} else if(strcmp(ptr, "--dataformat") == 0) {
 			Point point;
-			printf("The binary format is a one file per layer, in a large array Point structures\n");
+			printf("The binary format is a one file per layer, in a large array Point structures, ordered by row\n");
 			printf("Each array entry is %d bytes with elements:\n", (int)sizeof(point));
 			printf("\tTime     - uint16_t - %d bytes - timestep this point was taken\n", (int)sizeof(point.time));
 			printf("\tGrain    - uint16_t - %d bytes - grain this point was taken by\n", (int)sizeof(point.grain));
@@ -309,129 +260,328 @@ int main(int argc, char **argv){
 		} else if(strcmp(ptr, "-n") == 0 || strcmp(ptr, "--steps") == 0) {
 			ptr = argv[++i];
 			if(ptr == NULL) { printf("Please specify Number of steps\n"); exit(1); }
-			num_steps = atoi(ptr);
-			if(num_steps < 2 || num_steps > 65000){ printf("Num Steps out of range\n"); exit(2); }
+			c.num_steps = atoi(ptr);
+			if(c.num_steps < 2 || c.num_steps > MAXSTEPS){ printf("Num Steps out of range\n"); exit(2); }
 		} else if(strcmp(ptr, "-f") == 0 || strcmp(ptr, "--factor") == 0) {
 			ptr = argv[++i];
 			if(ptr == NULL) { printf("Please specify Growth factor\n"); exit(1); }
-			growth_factor = atof(ptr);
-			if(growth_factor <= 0 || growth_factor > 1.0) { printf("Growth factor out of range\n"); exit(2); }
+			c.growth_factor = atof(ptr);
+			if(c.growth_factor <= 0 || c.growth_factor > 1.0) { printf("Growth factor out of range\n"); exit(2); }
+		} else if(strcmp(ptr, "--adaptive") == 0) {
+			ptr = argv[++i];
+			if(ptr == NULL) { printf("Please specify the most a face may advance in a step\n"); exit(1); }
+			c.adaptive = atof(ptr);
+			if(c.adaptive <= 0) { printf("Adaptive advance out of range\n"); exit(2); }
 		} else if(strcmp(ptr, "-l") == 0 || strcmp(ptr, "--load") == 0) {
-			load_data = true;
+			c.load_data = true;
 		} else if(strcmp(ptr, "-g") == 0 || strcmp(ptr, "--grains") == 0) {
 			ptr = argv[++i];
 			if(ptr == NULL) { printf("Please specify Number of grains\n"); exit(1); }
-			num_grains = atoi(ptr);
-			if(num_grains < 1 || num_grains > 65000){ printf("Num Grains out of range\n"); exit(2); }
+			c.num_grains = atoi(ptr);
+			if(c.num_grains < 1 || c.num_grains > 65000){ printf("Num Grains out of range\n"); exit(2); }
 		} else if(strcmp(ptr, "-e") == 0 || strcmp(ptr, "--endgrains") == 0) {
 			ptr = argv[++i];
 			if(ptr == NULL) { printf("Please specify Number of end grains\n"); exit(1); }
-			end_grains = atoi(ptr);
-			if(end_grains < 0 || num_grains > 65000){ printf("Num end Grains out of range\n"); exit(2); }
+			c.end_grains = atoi(ptr);
+			if(c.end_grains < 0 || c.num_grains > 65000){ printf("Num end Grains out of range\n"); exit(2); }
 		} else if(strcmp(ptr, "-S") == 0 || strcmp(ptr, "--startangle") == 0) {
 			ptr = argv[++i];
 			if(ptr == NULL) { printf("Please specify Start Angle constant\n"); exit(1); }
-			start_angle = atof(ptr);
-			if(start_angle < 0){ printf("Start angle constant out of range\n"); exit(2); }
+			c.start_angle = atof(ptr);
+			if(c.start_angle < 0){ printf("Start angle constant out of range\n"); exit(2); }
 		} else if(strcmp(ptr, "--sep") == 0) {
 			ptr = argv[++i];
 			if(ptr == NULL) { printf("Please specify Minimum grain separation\n"); exit(1); }
-			min_dist = atof(ptr);
-			if(min_dist < 1){ printf("Grain separation out of range\n"); exit(1); }
+			c.min_dist = atof(ptr);
+			if(c.min_dist < 1){ printf("Grain separation out of range\n"); exit(1); }
 		} else if(strcmp(ptr, "-r") == 0 || strcmp(ptr, "--raystep") == 0) {
 			ptr = argv[++i];
 			if(ptr == NULL) { printf("Please specify step to start using flux\n"); exit(1); }
-			ray_step = atoi(ptr);
-			if(ray_step < 0){ printf("Ray step out of range\n"); exit(1); }
+			c.ray_step = atoi(ptr);
+			if(c.ray_step < 0){ printf("Ray step out of range\n"); exit(1); }
 		} else if(strcmp(ptr, "-R") == 0 || strcmp(ptr, "--rayratio") == 0) {
 			ptr = argv[++i];
 			if(ptr == NULL) { printf("Please specify ray ratio\n"); exit(1); }
-			ray_ratio = atoi(ptr);
-			if(ray_ratio < 1){ printf("Ray ratio out of range\n"); exit(1); }
+			c.ray_ratio = atof(ptr);
+			if(c.ray_ratio <= 0){ printf("Ray ratio out of range\n"); exit(1); }
 		} else if(strcmp(ptr, "-a") == 0 || strcmp(ptr, "--angleconst") == 0) {
 			ptr = argv[++i];
 			if(ptr == NULL) { printf("Please specify ray angle constant\n"); exit(1); }
-			ray_angle = atof(ptr);
-			if(ray_angle < 0){ printf("Ray angle constant out of range\n"); exit(1); }
+			c.ray_angle = atof(ptr);
+			if(c.ray_angle < 0){ printf("Ray angle constant out of range\n"); exit(1); }
 		} else if(strcmp(ptr, "-c") == 0 || strcmp(ptr, "--cutoff") == 0) {
 			ptr = argv[++i];
 			if(ptr == NULL) { printf("Please specify ray cutoff angle\n"); exit(1); }
-			ray_cutoff = atof(ptr);
-			if(ray_cutoff < 1 || ray_cutoff > 89){ printf("Ray cutoff angle out of range\n"); exit(1); }
+			c.ray_cutoff = atof(ptr);
+			if(c.ray_cutoff < 1 || c.ray_cutoff > 89){ printf("Ray cutoff angle out of range\n"); exit(1); }
 		} else if(strcmp(ptr, "-D") == 0 || strcmp(ptr, "--diffusion") == 0) {
 			ptr = argv[++i];
 			if(ptr == NULL) { printf("Please specify diffusion probability\n"); exit(1); }
-			diffusion = atof(ptr);
-			if(diffusion < 0 || diffusion >= 1){ printf("Diffusion probability out of range\n"); exit(1); }
+			c.diffusion = atof(ptr);
+			if(c.diffusion < 0 || c.diffusion >= 1){ printf("Diffusion probability out of range\n"); exit(1); }
 		} else if(strcmp(ptr, "-s") == 0 || strcmp(ptr, "--shape") == 0) {
 			ptr = argv[++i];
 			if(ptr == NULL) { printf("Please specify Shape\n"); exit(1);	}
-			shape_id = atoi(ptr);
+			c.shape_id = atoi(ptr);
 		} else if(strcmp(ptr, "--no-subdiff") == 0){
-			substrate_diffusion = false;
+			c.substrate_diffusion = false;
+		} else if(strcmp(ptr, "--horizon") == 0){
+			c.horizon = true;
+		} else if(strcmp(ptr, "--sobol") == 0){
+			c.sobol = true;
+		} else if(strcmp(ptr, "--jumprays") == 0){
+			c.jumprays = true;
+		} else if(strcmp(ptr, "--diffwalk") == 0){
+			ptr = argv[++i];
+			if(ptr == NULL) { printf("Please specify the diffusion walk\n"); exit(1); }
+			if(strcmp(ptr, "random") == 0)    c.facewalk = false;
+			else if(strcmp(ptr, "face") == 0) c.facewalk = true;
+			else { printf("Unknown diffusion walk %s\n", ptr); exit(1); }
 		} else {
 			printf("Unknown argument %s\n", ptr);
 			exit(1);
 		}
 	}
 
-	if(dir == NULL || chdir(dir) == -1){
-		printf("Couldn't switch directories to %s\n", dir); 
+}
+//one line of a batch file: the arguments it adds to the command line, and the run they make
+struct BatchRun {
+	char * line;
+	Config config;
+};
+
+//read the runs from the batch file, each line's arguments on top of the base command line. Lines starting with # are ignored
+vector<BatchRun> read_batch(const Config & base){
+	FILE * fd = fopen(base.batch, "r");
+	if(!fd){
+		printf("Couldn't open the batch file %s\n", base.batch);
+		exit(1);
+	}
+
+	vector<BatchRun> runs;
+	char buf[4096];
+	for(int num = 1; fgets(buf, sizeof(buf), fd); num++){
+		buf[strcspn(buf, "\r\n")] = '\0';
+
+		BatchRun run;
+		run.line = strdup(buf);
+		run.config = base;
+		run.config.dir = NULL;
+
+		//split a copy into arguments, the config keeps pointers into it
+		vector<char *> args(1, base.batch);
+		for(char * arg = strtok(strdup(buf), " \t"); arg; arg = strtok(NULL, " \t"))
+			args.push_back(arg);
+		if(args.size() == 1 || args[1][0] == '#')
+			continue;
+		args.push_back(NULL);
+
+		Options before = opts;
+		parse_args(args.size() - 1, &args[0], run.config);
+		const Config & c = run.config;
+
+		if(memcmp(&before, &opts, sizeof(Options)) != 0){
+			printf("Line %d of %s sets output options, which are shared by the whole batch\n", num, base.batch);
+			exit(1);
+		}
+		if(c.num_grains != base.num_grains || c.min_dist != base.min_dist || c.start_angle != base.start_angle || c.load_data != base.load_data){
+			printf("Line %d of %s changes the grain placement, which is shared by the whole batch\n", num, base.batch);
+			exit(1);
+		}
+		if(c.batch != base.batch || c.jobs != base.jobs || c.num_slabs != base.num_slabs || c.numa != base.numa){
+			printf("Line %d of %s sets a batch wide option\n", num, base.batch);
+			exit(1);
+		}
+		if(!find_shape(c.shape_id)){
+			printf("Unknown shape on line %d of %s\n", num, base.batch);
+			exit(1);
+		}
+
+		if(run.config.dir == NULL){
+			run.config.dir = new char[20];
+			sprintf(run.config.dir, "run.%03d", (int)runs.size() + 1);
+		}
+
+		runs.push_back(run);
+	}
+	fclose(fd);
+
+	return runs;
+}
+
+//one batch run, in its own directory under the base. Each gets its own working directory, shared with the
+//worker threads it starts, so the runs can go side by side in one process
+struct BatchRunReq : WorkRequest {
+	const BatchRun & job;
+	const char * base;
+	const char * cmdline;
+	const vector<Grain> & placed;
+	const Nodes * nodes;
+	int num, total;
+
+	BatchRunReq(const BatchRun & R, const char * B, const char * C, const vector<Grain> & P, const Nodes * Nd, int N, int T)
+		: job(R), base(B), cmdline(C), placed(P), nodes(Nd), num(N), total(T) { }
+
+	int64_t run(){
+		if(opts.interrupt)
+			return 0;
+
+		if(unshare(CLONE_FS) == -1 || chdir(base) == -1){
+			printf("Couldn't give run %d its own directory\n", num);
+			exit(2);
+		}
+		mkdir(job.config.dir, 0777);
+		if(chdir(job.config.dir) == -1){
+			printf("Couldn't switch directories to %s\n", job.config.dir);
+			exit(2);
+		}
+
+		if(opts.cmdline){
+			FILE *fd = fopen("cmdline.txt", "w");
+			fprintf(fd, "%s %s\n", cmdline, job.line);
+			fclose(fd);
+		}
+
+		int start = time_msec();
+		printf("Run %d of %d in %s: %s\n", num, total, job.config.dir, job.line);
+		fflush(stdout);
+
+		Simulation sim(job.config, NULL, nodes);
+		sim.init(&placed);
+		sim.run();
+
+		printf("Run %d of %d in %s finished in %d sec\n", num, total, job.config.dir, (time_msec() - start)/1000);
+		fflush(stdout);
+		return 1;
+	}
+};
+
+int main(int argc, char **argv){
+	srand(time(NULL));
+
+	signal(SIGINT,  interrupt);
+	signal(SIGTERM, interrupt);
+
+	opts.cmdline   = true;
+	opts.console   = true;
+	opts.layerstats= true;
+	opts.timestats = true;
+	opts.layermap  = true;
+	opts.slopemap  = true;
+	opts.isomorphic= false;
+	opts.surf3d    = false;
+	opts.perspective= false;
+	opts.heightmap = false;
+	opts.heightdump= false;
+	opts.timemap   = false;
+	opts.fluxdump  = false;
+	opts.peaks     = false;
+	opts.voronei   = false;
+	opts.graininit = false;
+	opts.datadump  = false;
+	opts.savemem   = false;
+	opts.pockets   = false;
+	opts.interrupt = false;
+	opts.randcolor = false;
+	opts.batch     = false;
+
+	Config c;
+	parse_args(argc, argv, c);
+
+	vector<BatchRun> runs;
+	if(c.batch){
+		if(c.num_slabs > 1){
+			printf("Batch runs can't use slabs\n");
+			exit(1);
+		}
+		runs = read_batch(c); //before changing directory, the file is relative to here
+	}
+
+	if(c.dir == NULL || chdir(c.dir) == -1){
+		printf("Couldn't switch directories to %s\n", c.dir); 
 		exit(2);
 	}
 
+	string cmdline;
+	for(int i = 0; i < argc; i++)
+		cmdline += string(argv[i]) + (i + 1 < argc ? " " : "");
+
 	if(opts.cmdline){
 		FILE *fd = fopen("cmdline.txt", "w");
-		for(int i = 0; i < argc; i++)
-			fprintf(fd, "%s ", argv[i]);
-		fprintf(fd, "\n");
+		fprintf(fd, "%s \n", cmdline.c_str());
 		fclose(fd);
 	}
 
-	if(min_dist == 0.0)
-		min_dist = sqrt(FIELD*FIELD/(M_PI*num_grains));
-
-	Shape shape;
-
-	switch(shape_id){
-		case 4:  shape = Tetrahedron;          break;
-		case 5:  shape = Stretched_cube;       break;
-		case 6:  shape = Cube;                 break;
-		case 7:  shape = Twin_tetrahedron;     break;
-		case 8:  shape = Octahedron;           break;
-		case 9:  shape = Stretched_hex;        break;
-		case 12: shape = Dodecahedron;         break;
-		case 13: shape = Rhombic_dodecahedron; break;
-		case 14: shape = Cuboctahedron;        break;
-		case 20: shape = Icosahedron;          break;
-		case 26: shape = Rhombic_Cuboctahedron;break;
-		case 252:shape = Sphere252;            break;
-		default: printf("Unknown shape\n"); exit(1);
+	if(!find_shape(c.shape_id)){
+		printf("Unknown shape\n");
+		exit(1);
 	}
 
+	if(opts.psd && (FIELD & (FIELD - 1))){
+		printf("--psd needs FIELD to be a power of 2\n");
+		exit(1);
+	}
 
+	Nodes * nodes = (c.numa ? new Nodes() : NULL);
 
-	Growth growth(threads);
+	//the grains are placed once for the whole batch, then the runs are shared out between the jobs
+	if(c.batch){
+		vector<Grain> placed = Simulation::place(c);
 
-	growth.num_steps = num_steps;
-	growth.end_grains = end_grains;
-	growth.growth_factor = growth_factor;
-	
-	growth.max_memory = max_memory;
+		if(!c.load_data && opts.graininit)
+			Growth::write_grains(placed);
+		if(opts.voronei)
+			Stats::voroneimap(placed);
 
-	growth.start_angle = start_angle;
-	growth.ray_angle   = ray_angle;
-	growth.ray_cutoff  = ray_cutoff;
-	growth.ray_step    = ray_step;
-	growth.ray_ratio   = ray_ratio;
-	
-	growth.diffusion_probability = diffusion;
-	growth.substrate_diffusion = substrate_diffusion;
+		opts.batch = (c.jobs > 1);
 
-	growth.init(num_grains, min_dist, shape, load_data);
+		char base[4096];
+		if(!getcwd(base, sizeof(base))){
+			printf("Couldn't find the current directory\n");
+			exit(2);
+		}
+
+		Worker jobs(c.jobs);
+		for(unsigned int i = 0; i < runs.size(); i++)
+			jobs.add(new BatchRunReq(runs[i], base, cmdline.c_str(), placed, nodes, i + 1, runs.size()));
+		int done = jobs.wait();
+
+		printf("Finished %d of %d runs\n", done, (int)runs.size());
+		delete nodes;
+		return 0;
+	}
 
-	growth.run();
+	//the other outputs and options need whole planes, which no slab has
+	if(c.num_slabs > 1){
+		if(c.diffusion > 0 || c.horizon || c.jumprays || opts.savemem || opts.pockets || opts.datadump){
+			printf("Diffusion, horizon, jumprays, savemem, pockets and datadump don't work with slabs\n");
+			exit(1);
+		}
+		opts.layerstats = opts.layermap = opts.grainstats = opts.slopemap = opts.isomorphic = opts.surf3d = false;
+		opts.heightmap = opts.timemap = opts.fluxdump = opts.peaks = opts.tracks = opts.psd = opts.texture = opts.events = opts.voronei = false;
+	}
+
+	//fork before any threads start, the others are quiet and leave the output to the first
+	Slabs * slabs = NULL;
+	if(c.num_slabs > 1){
+		slabs = new Slabs(c.num_slabs, SECTOR_H);
+		if(slabs->rank){
+			if(freopen("/dev/null", "w", stdout));
+			opts.console = opts.growth = opts.heightdump = opts.graininit = false;
+		}
+	}
+
+	Simulation sim(c, slabs, nodes);
+	sim.init();
+	sim.run();
+
+	if(slabs){
+		if(slabs->rank)
+			exit(0);
+		delete slabs;
+	}
+
+	delete nodes;
 
 	return 0;
 }
-
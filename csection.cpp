@@ -4,15 +4,74 @@
 #include <cstring>
 #include <unistd.h>
 #include <stdint.h>
+#include <vector>
+#include <algorithm>
+#include <pthread.h>
 #include "gd.h"
 
 using namespace std;
 
+#ifndef MAX_THREADS
+#define MAX_THREADS 100
+#endif
+
+#include "worker.h"
+
+//decode one layer and copy each requested row into its cross section
+struct LayerReq : WorkRequest {
+	int h, size, height, start;
+	vector<gdImagePtr> * sections;
+
+	LayerReq(int H, int S, int Ht, int St, vector<gdImagePtr> * secs) : h(H), size(S), height(Ht), start(St), sections(secs) { }
+
+	int64_t run(){
+		char filename[50];
+		sprintf(filename, "layer.%05d.png", h);
+		FILE * fd = fopen(filename, "rb");
+		if(fd == NULL)
+			return 0;
+		gdImagePtr layerim = gdImageCreateFromPng(fd);
+		fclose(fd);
+
+		if(gdImageSX(layerim) != size || gdImageSY(layerim) != size){
+			printf("File %s is not the expected size\n", filename);
+			exit(1);
+		}
+
+		//each layer owns one line of every section, so no locking is needed
+		for(unsigned int i = 0; i < sections->size(); i++)
+			gdImageCopy((*sections)[i], layerim, 0, height - h - 1, 0, start + i, size, 1); //copy one line into place
+
+		gdImageDestroy(layerim);
+
+		return 1;
+	}
+};
+
+struct SaveReq : WorkRequest {
+	int y;
+	gdImagePtr im;
+
+	SaveReq(int Y, gdImagePtr IM) : y(Y), im(IM) { }
+
+	int64_t run(){
+		char filename[50];
+		sprintf(filename, "csection.%05d.png", y);
+		FILE * fd = fopen(filename, "wb");
+		gdImagePng(im, fd);
+		fclose(fd);
+		gdImageDestroy(im);
+		return 0;
+	}
+};
+
 int main(int argc, char **argv){
 	int size = (1<<10); //1024
 	int height = size;
 	int start = 0;
 	int end = 0;
+	int threads = min(4, MAX_THREADS);
+	int memory = 1024;
 
 	for(unsigned int i = 1; i < (unsigned int)argc; i++){
 		char * ptr = argv[i];
@@ -25,8 +84,10 @@ int main(int argc, char **argv){
  				"\t-H --height   Max Height [%d]\n"
  				"\t-A --start    First cross section [%d]\n"
  				"\t-B --end      Last cross section  [%d]\n"
+ 				"\t-t --threads  Number of threads decoding layers [%d]\n"
+ 				"\t-m --memory   Memory for cross sections in Mb, more sections per pass over the layers [%d]\n"
 				"\n",
-				argv[0], argv[0], size, height, start, end);
+				argv[0], argv[0], size, height, start, end, threads, memory);
 			exit(255);
 		} else if(strcmp(ptr, "-d") == 0 || strcmp(ptr, "--dir") == 0) {
 			ptr = argv[++i];
@@ -50,6 +111,16 @@ int main(int argc, char **argv){
 			ptr = argv[++i];
 			if(ptr == NULL) { printf("Please specify the End\n"); exit(1); }
 			end = atoi(ptr);
+		} else if(strcmp(ptr, "-t") == 0 || strcmp(ptr, "--threads") == 0) {
+			ptr = argv[++i];
+			if(ptr == NULL) { printf("Please specify the thread count\n"); exit(1); }
+			threads = atoi(ptr);
+			if(threads < 1 || threads > MAX_THREADS){ printf("Thread count out of range, max: %d\n", MAX_THREADS); exit(2); }
+		} else if(strcmp(ptr, "-m") == 0 || strcmp(ptr, "--memory") == 0) {
+			ptr = argv[++i];
+			if(ptr == NULL) { printf("Please specify the Memory\n"); exit(1); }
+			memory = atoi(ptr);
+			if(memory < 1){ printf("Memory out of range\n"); exit(2); }
 		} else {
 			printf("Unknown argument %s\n", ptr);
 			exit(1);
@@ -61,41 +132,44 @@ int main(int argc, char **argv){
 		exit(1);
 	}
 
-	int count = 0;
-	for(int y = start; y <= end; y++){
+	//only go up to the first missing layer
+	int layers = 0;
+	for(; layers < height; layers++){
 		char filename[50];
-		FILE *fd;
-
-		gdImagePtr im = gdImageCreateTrueColor(size, height);
-		gdImageFill(im, 0, 0, gdImageColorAllocate(im, 0, 0, 0));
+		sprintf(filename, "layer.%05d.png", layers);
+		if(access(filename, R_OK) != 0)
+			break;
+	}
 
-		for(int h = 0; h < height; h++){
-			sprintf(filename, "layer.%05d.png", h);
-			fd = fopen(filename, "rb");
-			if(fd == NULL)
-				break;
-			gdImagePtr layerim = gdImageCreateFromPng(fd);
-			fclose(fd);
+	//as many sections as fit in memory are built at once, each pass decodes every layer once
+	int batch = max(1, (int)(((int64_t)memory*1024*1024) / ((int64_t)size*height*4)));
 
-			if(gdImageSX(layerim) != size || gdImageSY(layerim) != size){
-				printf("File %s is not the expected size\n", filename);
-				exit(1);
-			}
+	Worker worker(threads);
 
-			gdImageCopy(im, layerim, 0, height - h - 1, 0, y, size, 1); //copy one line into place
+	int count = 0;
+	for(int first = start; first <= end; first += batch){
+		int last = min(end, first + batch - 1);
 
-			gdImageDestroy(layerim);
+		vector<gdImagePtr> sections;
+		for(int y = first; y <= last; y++){
+			gdImagePtr im = gdImageCreateTrueColor(size, height);
+			gdImageFill(im, 0, 0, gdImageColorAllocate(im, 0, 0, 0));
+			sections.push_back(im);
 		}
 
-		sprintf(filename, "csection.%05d.png", y);
-		fd = fopen(filename, "wb");
-		gdImagePng(im, fd);
-		fclose(fd);
-		gdImageDestroy(im);
+		for(int h = 0; h < layers; h++)
+			worker.add(new LayerReq(h, size, height, first, &sections));
+		worker.wait();
 
-		printf(".");
-		if(++count % 50 == 0)
-			printf("\n");
+		for(int y = first; y <= last; y++)
+			worker.add(new SaveReq(y, sections[y - first]));
+		worker.wait();
+
+		for(int y = first; y <= last; y++){
+			printf(".");
+			if(++count % 50 == 0)
+				printf("\n");
+		}
 		fflush(stdout);
 	}
 	printf("\n");
@@ -59,6 +59,11 @@ struct Face {
 		return amnt;
 	}
 
+	//distance the face moves per unit of flux
+	double speed() const {
+		return D / sqrt(vec.a*vec.a + vec.b*vec.b + vec.c*vec.c);
+	}
+
 	void grow(double amnt){
 		dF = amnt;
 		F += amnt;
@@ -125,19 +130,7 @@ public:
 	}
 
 	void directional_color(){
-		double vec[3];
-		vec[0] = fabs(sin(phi)*sin(theta1));
-		vec[1] = fabs(cos(theta1)*sin(phi));
-		vec[2] = fabs(cos(phi));
-
-		sort(vec, vec+3);
-
-		vec[0] /= vec[2];
-		vec[1] /= vec[2];
-		vec[2] /= vec[2];
-
-		HSV hsv = HSV(RGB(vec[0], vec[1] - vec[0], vec[2] - vec[1]));
-		color = hsv.h;
+		color = directional_hue(theta1, phi);
 
 		fix_face_colors();
 	}
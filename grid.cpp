@@ -3,13 +3,35 @@
 #include "coord.h"
 #include "ray.h"
 #include "color.h"
+#include "worker.h"
+#include "point.h"
+#include "slabs.h"
+#include "plugins.h"
 
-#define FULLPOINT (0xFFFF) //internal value to mean this point was dropped to disk
-#define THREAT    (0xFFFE) //this point is threatened by other points, but is empty
-#define POCKET    (0xFFFD) //this point is empty space, but can never be taken since it is in a pocket
-#define TPOCKET   (0xFFFC) //also in a pocket, but at the edge of the pocket and threatened
-#define MARK      (0xFFFB) //marks a threat for the mark/sweep pocket search
-#define MAXGRAIN  (0xFFF0) //max amount of grains, anything above is reserved for special values
+//Each Sector holds FIELD points. By default a sector is one row along x, but with TILED it is a
+//SECTOR_W x SECTOR_H tile stored in morton order, so a 3x3 stencil stays within one or two sectors
+//per plane instead of touching three rows. Only the in memory layout changes, dumps stay row ordered.
+#ifdef TILED
+
+#if (FIELD & (FIELD - 1))
+#error TILED needs FIELD to be a power of 2
+#endif
+
+template <int N> struct Log2    { enum { val = 1 + Log2<N/2>::val }; };
+template <>      struct Log2<1> { enum { val = 0 }; };
+
+#define SECTOR_W (1 << ((Log2<FIELD>::val + 1)/2))
+#define SECTOR_H (FIELD/SECTOR_W)
+
+#else
+
+#define SECTOR_W FIELD
+#define SECTOR_H 1
+
+#endif
+
+#define SECTORS_X (FIELD/SECTOR_W) //number of sectors along x in a plane
+#define SECTORS_Y (FIELD/SECTOR_H) //number of sectors along y in a plane
 
 
 struct Threat {
@@ -17,28 +39,36 @@ struct Threat {
 	uint8_t  face;
 };
 
+//a grain losing the last column it was on top of, buried by other, or getting one back by covering other
+struct SurfaceEvent {
+	int t;
+	uint16_t grain, other;
+	bool buried;
+
+	SurfaceEvent(int T, uint16_t G, uint16_t O, bool B) : t(T), grain(G), other(O), buried(B) { }
+
+	//a full order so write_events comes out the same however the threads interleaved, burials first within a step
+	bool operator<(const SurfaceEvent & e) const {
+		if(t != e.t)
+			return t < e.t;
+		if(grain != e.grain)
+			return grain < e.grain;
+		if(buried != e.buried)
+			return buried;
+		return other < e.other;
+	}
+};
 
-struct Point {
-	uint16_t time;  // time it was taken
-	uint16_t grain; // grain that took it
-	uint8_t  face;  // face on that grain
-	uint8_t  diffprob; //probability of diffusion from the point. Only makes sense if this point is a threat
+//a point set along the edge of a slab, to be mirrored by the slab next to it
+struct EdgePoint {
+	int x, y, z;
+	Point p;
 
-	Point(){
-		time = 0;
-		grain = 0;
-		face = 0;
-		diffprob = 0;
-	}
-	
-	Point(uint16_t t, uint16_t g, uint8_t f, uint8_t d){
-		time = t;
-		grain = g;
-		face = f;
-		diffprob = d;
-	}
+	EdgePoint(){ }
+	EdgePoint(int X, int Y, int Z, const Point & P) : x(X), y(Y), z(Z), p(P) { }
 };
 
+
 Point empty_point;
 Point full_point = Point(FULLPOINT, FULLPOINT, 0xFE, 0);
 
@@ -70,11 +100,7 @@ struct Sector {
 	}
 
 	bool unmark(int i){
-		if(marked(i)){
-			points[i].grain = THREAT;
-			return true;
-		}
-		return false;
+		return (points && CAS(points[i].grain, MARK, THREAT));
 	}
 	
 	bool marked(int i){
@@ -98,7 +124,7 @@ struct Sector {
 			points[i].time = t;
 	}
 
-	Point * get(int i){
+	Point * get(int i) const {
 		if(points)
 			return &(points[i]);
 		if(fullpoints)
@@ -110,6 +136,11 @@ struct Sector {
 		return (fullpoints == FIELD);
 	}
 
+	//may have threats or empty space, ie worth searching for pockets
+	bool live(){
+		return (points && !full());
+	}
+
 	void dump(FILE * fd){
 		if(points){ //write out the data
 			if(fwrite(points, sizeof(Point), FIELD, fd));
@@ -140,15 +171,47 @@ struct Sector {
 };
 
 struct Plane {
-	Sector grid[FIELD];
+	Sector grid[SECTORS_X*SECTORS_Y];
 	int taken;
 	int time;
 	FILE * data_fd;
+	uint8_t * dist; //distance to the nearest threat, indexed y*FIELD+x, see Grid::build_threat_dist
+
+	//spread the bits of v out to every other bit, for building morton indexes
+	static int spread(int v){
+		v = (v | (v << 8)) & 0x00FF00FF;
+		v = (v | (v << 4)) & 0x0F0F0F0F;
+		v = (v | (v << 2)) & 0x33333333;
+		v = (v | (v << 1)) & 0x55555555;
+		return v;
+	}
+
+	//which sector holds x,y
+	static int sector(int x, int y){
+		return (y / SECTOR_H) * SECTORS_X + x / SECTOR_W;
+	}
+
+	//where x,y is within its sector
+	static int index(int x, int y){
+#ifdef TILED
+		return spread(x % SECTOR_W) | (spread(y % SECTOR_H) << 1);
+#else
+		return x;
+#endif
+	}
+
+	//the sector dx,dy sectors away from sector s, wrapping periodically
+	static int neighbour(int s, int dx, int dy){
+		int sx = (s % SECTORS_X + dx + SECTORS_X) % SECTORS_X;
+		int sy = (s / SECTORS_X + dy + SECTORS_Y) % SECTORS_Y;
+		return sy * SECTORS_X + sx;
+	}
 
 	Plane(){
 		time = 0;
 		taken = 0;
 		data_fd = NULL;
+		dist = NULL;
 	}
 
 	~Plane(){
@@ -156,39 +219,54 @@ struct Plane {
 			fclose(data_fd);
 			data_fd = NULL;
 		}
+		delete[] dist;
 	}
 
 	long memory_usage(){
 		long mem = sizeof(Plane);
-		for(int i = 0; i < FIELD; i++)
+		for(int i = 0; i < SECTORS_X*SECTORS_Y; i++)
 			if(grid[i].points)
 				mem += sizeof(Point)*FIELD;
+		if(dist)
+			mem += FIELD*FIELD;
 		return mem;
 	}
 
-	Point * get(int x, int y){
-		return grid[y].get(x);
+	Point * get(int x, int y) const {
+		return grid[sector(x, y)].get(index(x, y));
+	}
+
+	//number of points set in rows y1 to y2, which must start and end on sector boundaries
+	int count(int y1, int y2){
+		int num = 0;
+		for(int s = sector(0, y1); s <= sector(FIELD - 1, y2 - 1); s++)
+			num += grid[s].fullpoints;
+		return num;
 	}
 
 	void set(int x, int y, Point & p){
-		grid[y].set(x, p);
+		grid[sector(x, y)].set(index(x, y), p);
 
 		INCR(taken);
 		time = p.time;
 	}
 	
 	void set_threat(int x, int y, int t){
-		grid[y].set_threat(x, t);
+		grid[sector(x, y)].set_threat(index(x, y), t);
+	}
+
+	bool live(int x, int y){
+		return grid[sector(x, y)].live();
 	}
 
 	bool marked(int x, int y){
-		return grid[y].marked(x);
+		return grid[sector(x, y)].marked(index(x, y));
 	}	
 	void mark(int x, int y){
-		grid[y].mark(x);
+		grid[sector(x, y)].mark(index(x, y));
 	}
 	bool unmark(int x, int y){
-		return grid[y].unmark(x);
+		return grid[sector(x, y)].unmark(index(x, y));
 	}
 
 	void dump(int layer, int sector = -1){
@@ -208,8 +286,21 @@ struct Plane {
 		}
 
 		if(sector == -1){
+			fseek(data_fd, 0, SEEK_SET);
+#ifdef TILED
+			//write it out in rows, assumes any sectors dumped earlier have been loaded back
+			Point row[FIELD];
+			for(int y = 0; y < FIELD; y++){
+				for(int x = 0; x < FIELD; x++)
+					row[x] = *get(x, y);
+				if(fwrite(row, sizeof(Point), FIELD, data_fd));
+			}
+			for(int i = 0; i < SECTORS_X*SECTORS_Y; i++)
+				grid[i].drop();
+#else
 			for(int y = 0; y < FIELD; y++)
 				grid[y].dump(data_fd);
+#endif
 		}else{
 			fseek(data_fd, sizeof(Point)*FIELD*sector, SEEK_SET);
 			grid[sector].dump(data_fd);
@@ -229,6 +320,9 @@ struct Plane {
 	}
 
 	bool load(int layer){
+		if(data_fd) //make sure sectors dumped earlier are actually in the file
+			fflush(data_fd);
+
 		char filename[50];
 		sprintf(filename, "data.%05d.dat", layer);
 		FILE * fd = fopen(filename, "rb");
@@ -236,8 +330,8 @@ struct Plane {
 		if(!fd)
 			return false;
 
-		for(int y = 0; y < FIELD; y++)
-			grid[y].load(fd);
+		for(int i = 0; i < SECTORS_X*SECTORS_Y; i++)
+			grid[i].load(fd);
 
 		fclose(fd);
 
@@ -298,13 +392,82 @@ struct Plane {
 };
 
 class Grid {
+	struct MarkReq : WorkRequest {
+		Grid * g;
+		int z;
+		MarkReq(Grid * G, int Z) : g(G), z(Z) { }
+		int64_t run(){
+			g->mark_plane(z);
+			return 0;
+		}
+	};
+
+	struct UnmarkReq : WorkRequest {
+		Grid * g;
+		const Coord3i * begin, * end;
+		vector<Coord3i> * next;
+		UnmarkReq(Grid * G, const Coord3i * B, const Coord3i * E, vector<Coord3i> * N) : g(G), begin(B), end(E), next(N) { }
+		int64_t run(){
+			return g->unmark_frontier(begin, end, *next);
+		}
+	};
+
+	struct FindMarkedReq : WorkRequest {
+		Grid * g;
+		int z;
+		vector<Coord3i> * marked;
+		FindMarkedReq(Grid * G, int Z, vector<Coord3i> * M) : g(G), z(Z), marked(M) { }
+		int64_t run(){
+			g->find_marked(z, *marked);
+			return 0;
+		}
+	};
+
+	struct ThreatDistReq : WorkRequest {
+		Grid * g;
+		int pass, line;
+		ThreatDistReq(Grid * G, int P, int L) : g(G), pass(P), line(L) { }
+		int64_t run(){
+			if(pass == 0)
+				g->threat_dist_plane(line);
+			else
+				g->threat_dist_columns(line);
+			return 0;
+		}
+	};
+
 public:
 	Plane * planes[10000]; //better be deep enough...
 	uint16_t heights[FIELD][FIELD];
+	uint16_t tops[FIELD][FIELD]; //heights+1 of the rows this process grows, 0 for a column that's still empty
 	uint8_t flux[FIELD][FIELD];
 
 	int surfacethreats;
 
+	//with --pockets, set_point records points that may have closed off a pocket, checked by close_pockets
+	vector<Coord3i> closures;
+	pthread_mutex_t closures_lock;
+	bool pocket_overflow; //a closure was too big to check locally, so the full pocketsearch is needed
+	static const int pocket_limit = 4096; //biggest pocket to find locally
+	//steps between full pocketsearches with --pockets, for pockets sealed by two points set at once that each saw
+	//it open through the other's cell. Well under the 25 steps before an inactive plane is dumped
+	static const int pocket_backstop = 10;
+	//with --slabs, the other processes sharing the run, otherwise NULL. This process owns rows ybegin to yend and
+	//only grows those, the row either side mirrors the neighbouring slabs through exchange_edges
+	Slabs * slabs;
+	int ybegin, yend;
+	vector<EdgePoint> edges; //points set in the first or last row since the last exchange_edges
+	pthread_mutex_t edges_lock;
+
+	vector<int> surface; //columns each grain is on top of, kept by set_point once it's sized for the grains
+	int alive; //grains with any columns
+	vector<SurfaceEvent> events; //with --events, since the last write_events
+	pthread_mutex_t events_lock;
+	vector<Coord3i> peaks; //with --peaks or --tracks, each grain's peak as of the last step, see Stats::find_peaks
+	vector<Plugin *> plugins; //analyses run as each layer is finished and after each step, owned by the Simulation
+
+	static const int threat_dist_cap = 15; //threat distances stop here, so the squares fit a byte between passes
+
 	//quick linear scan, quick because the list will always be tiny
 	static Threat * find(Threat * pos, Threat * end, uint16_t grain, uint8_t face){
 		while(pos != end && pos->grain != grain && pos->face != face) ++pos;
@@ -322,16 +485,27 @@ public:
 		zmin = 0;
 		zmax = 3;
 
+		pocket_overflow = false;
+		pthread_mutex_init(&closures_lock, NULL);
+
+		slabs = NULL;
+		ybegin = 0;
+		yend = FIELD;
+		pthread_mutex_init(&edges_lock, NULL);
+
+		alive = 0;
+		pthread_mutex_init(&events_lock, NULL);
+
 		for(int i = zmin; i < zmax; i++)
 			planes[i] = new Plane();
 
 		for(int y = 0; y < FIELD; y++)
 			for(int x = 0; x < FIELD; x++)
-				heights[y][x] = 0;
+				heights[y][x] = tops[y][x] = 0;
 	}
 
 	long memory_usage(){
-		long mem = sizeof(heights) + sizeof(flux);
+		long mem = sizeof(heights) + sizeof(tops) + sizeof(flux);
 
 		for(int i = zmin; i < zmax; i++)
 			mem += planes[i]->memory_usage();
@@ -340,25 +514,186 @@ public:
 	}
 
 
-	int graincount(int maxgraincount) const {
-		vector<int> counts(maxgraincount, 0);
+	//number of grains showing on the surface, over all the slabs
+	//grains on top of any column, from the counts set_point keeps. A grain can be on top in several slabs, so with
+	//slabs the counts are added up first
+	int graincount() const {
+		if(!slabs)
+			return alive;
 
-		for(int y = 0; y < FIELD; y++){
-			for(int x = 0; x < FIELD; x++){
-				int grain = get_grain(x, y, heights[y][x]);
-				if(grain != 0 && grain < MAXGRAIN)
-					counts[grain]++;
-			}
-		}
+		vector<int64_t> counts(surface.begin(), surface.end());
+		if(counts.empty())
+			return 0;
+		slabs->sum(&counts[0], counts.size());
 
 		int num = 0;
-		for(int i = 1; i < maxgraincount; i++) //start at 1 since 0 is a special grain
+		for(unsigned int i = 1; i < counts.size(); i++) //start at 1 since 0 is a special grain
 			if(counts[i])
 				num++;
 
 		return num;
 	}
 
+	//append the events since the last call to events.csv
+	void write_events(){
+		sort(events.begin(), events.end());
+
+		FILE * fd = fopen("events.csv", "a");
+		for(unsigned int i = 0; i < events.size(); i++)
+			fprintf(fd, "%d,%d,%s,%d\n", events[i].t, events[i].grain, (events[i].buried ? "buried" : "emerged"), events[i].other);
+		fclose(fd);
+
+		events.clear();
+	}
+
+	//distance from each point of the live window to the nearest threat, for walkers to jump by instead of stepping.
+	//Exact euclidean distances between points, capped at threat_dist_cap, built in three passes of the 1d transform:
+	//along x then y within each plane, then down the columns. Valid until the grid changes
+	void build_threat_dist(Worker * worker){
+		for(int z = zmin; z < zmax; z++){
+			if(!planes[z]->dist)
+				planes[z]->dist = new uint8_t[FIELD*FIELD];
+			worker->add(new ThreatDistReq(this, 0, z));
+		}
+		worker->wait();
+
+		for(int y = 0; y < FIELD; y++)
+			worker->add(new ThreatDistReq(this, 1, y));
+		worker->wait();
+	}
+
+	//distance from x,y,z to the nearest threat rounded down, or 0 if it isn't known. A point closer to x,y,z than this
+	//can't be a threat
+	int threat_dist(int x, int y, int z) const {
+		if(z < zmin || z >= zmax || !planes[z]->dist)
+			return 0;
+		fix_period(x, y);
+		return planes[z]->dist[y*FIELD + x];
+	}
+
+	//squared distances within plane z, stored capped at threat_dist_cap squared for threat_dist_columns to finish
+	void threat_dist_plane(int z){
+		const int cap = threat_dist_cap*threat_dist_cap;
+		int * f = new int[FIELD*FIELD];
+		int row[FIELD], d[FIELD];
+
+		for(int y = 0; y < FIELD; y++){
+			for(int x = 0; x < FIELD; x++)
+				row[x] = (get_grain(x, y, z) == THREAT ? 0 : cap);
+			dist_transform(row, d, FIELD, threat_dist_cap);
+			for(int x = 0; x < FIELD; x++)
+				f[y*FIELD + x] = d[x];
+		}
+
+		uint8_t * dist = planes[z]->dist;
+		for(int x = 0; x < FIELD; x++){
+			for(int y = 0; y < FIELD; y++)
+				row[y] = min(f[y*FIELD + x], cap);
+			dist_transform(row, d, FIELD, threat_dist_cap);
+			for(int y = 0; y < FIELD; y++)
+				dist[y*FIELD + x] = min(d[y], cap);
+		}
+
+		delete[] f;
+	}
+
+	//finish the columns of row y. Nothing below zmin is reachable and nothing above zmax is a threat, so the columns don't wrap
+	void threat_dist_columns(int y){
+		int n = zmax - zmin;
+		vector<int> col(n), d(n);
+
+		for(int x = 0; x < FIELD; x++){
+			for(int z = zmin; z < zmax; z++)
+				col[z - zmin] = planes[z]->dist[y*FIELD + x];
+			dist_transform(&col[0], &d[0], n, 0);
+			for(int z = zmin; z < zmax; z++)
+				planes[z]->dist[y*FIELD + x] = (uint8_t)sqrt((double)min(d[z - zmin], threat_dist_cap*threat_dist_cap));
+		}
+	}
+
+	//d[q] = min over p of f[p] + (q-p)^2, the lower envelope of parabolas rooted at each f[p].
+	//With wrap > 0 the sites run wrap past each end around to the other side, for periodic lines
+	static void dist_transform(const int * f, int * d, int n, int wrap){
+		int m = n + 2*wrap;
+		vector<int> g(m), v(m);
+		vector<float> zb(m + 1);
+
+		for(int i = 0; i < m; i++){
+			int p = i - wrap;
+			g[i] = f[p < 0 ? p + n : (p >= n ? p - n : p)];
+		}
+
+		int k = 0;
+		v[0] = 0;
+		zb[0] = -1e20;
+		zb[1] = 1e20;
+
+		for(int p = 1; p < m; p++){
+			float s;
+			while(true){
+				int r = v[k];
+				s = (float)((g[p] + p*p) - (g[r] + r*r)) / (2*(p - r));
+				if(s > zb[k])
+					break;
+				k--;
+			}
+			k++;
+			v[k] = p;
+			zb[k] = s;
+			zb[k+1] = 1e20;
+		}
+
+		for(int q = wrap, j = 0; q < n + wrap; q++){
+			while(zb[j+1] < q)
+				j++;
+			d[q - wrap] = (q - v[j])*(q - v[j]) + g[v[j]];
+		}
+	}
+
+	//split the field with the other slabs, see slabs
+	void set_slabs(Slabs * s){
+		slabs = s;
+		ybegin = s->ybegin;
+		yend = s->yend;
+	}
+
+	bool owns(int x, int y) const {
+		fix_period(x, y);
+		return (y >= ybegin && y < yend);
+	}
+
+	//send the points set along the edges of this slab to the neighbours, and mirror theirs in the rows either side,
+	//which also marks the threats they make on this slab's own rows. The mirrored points are returned in received if given
+	void exchange_edges(vector<EdgePoint> * received = NULL){
+		vector< vector<EdgePoint> > out(slabs->num);
+		int x = 0, before = ybegin - 1, after = yend;
+		fix_period(x, before);
+		fix_period(x, after);
+
+		for(unsigned int i = 0; i < edges.size(); i++){
+			if(edges[i].y == ybegin)
+				out[slabs->owner(before)].push_back(edges[i]);
+			if(edges[i].y == yend - 1)
+				out[slabs->owner(after)].push_back(edges[i]);
+		}
+		edges.clear();
+
+		vector<EdgePoint> in;
+		slabs->exchange(&out[0], in);
+
+		for(unsigned int i = 0; i < in.size(); i++)
+			set_point(in[i].x, in[i].y, in[i].z, in[i].p.time, in[i].p.grain, in[i].p.face);
+
+		if(received)
+			received->swap(in);
+	}
+
+	//heights of the whole field from each slab's own rows
+	void gather_heights(){
+		if(slabs)
+			slabs->gather_rows(heights);
+	}
+
 	double mean_height() const {
 		uint64_t totalheight = 0;
 		for(int y = 0; y < FIELD; y++)
@@ -370,7 +705,11 @@ public:
 
 	// keep two empty planes on the top
 	bool growgrid(){
-		if(planes[zmax-2]->taken){
+		int taken = planes[zmax-2]->taken;
+		if(slabs)
+			taken = slabs->max(taken);
+
+		if(taken){
 			try{
 				planes[zmax] = new Plane();
 			}catch(std::bad_alloc){
@@ -381,53 +720,111 @@ public:
 		return true;
 	}
 
-	void pocketsearch(){
+	void pocketsearch(Worker * worker){
+		pocket_overflow = false;
+
 		//set all threats to MARK, ie threats that haven't been validated as executable threats
 		for(int z = zmin; z < zmax; z++)
-			for(int y = 0; y < FIELD; y++)
-				for(int x = 0; x < FIELD; x++)
-					planes[z]->mark(x, y);
+			worker->add(new MarkReq(this, z));
+		worker->wait();
 
 		surfacethreats = 0;
 
 		//reset all surface threats to actual THREATs
-		unmark(0, 0, heights[0][0]+1);
-		
-		//search for still MARKed threats, set them to TPOCKET, fill the internal space with POCKET
+		unmark(worker, 0, 0, heights[0][0]+1);
+
+		//search for still MARKed threats
+		vector< vector<Coord3i> > marked(zmax - zmin);
 		for(int z = zmin; z < zmax; z++)
-			for(int y = 0; y < FIELD; y++)
-				for(int x = 0; x < FIELD; x++)
-					if(planes[z]->marked(x, y))
-						sweep_pockets(x, y, z);
+			worker->add(new FindMarkedReq(this, z, &marked[z - zmin]));
+		worker->wait();
+
+		//set them to TPOCKET, fill the internal space with POCKET
+		for(unsigned int i = 0; i < marked.size(); i++)
+			for(vector<Coord3i>::iterator c = marked[i].begin(); c != marked[i].end(); ++c)
+				if(planes[c->z]->marked(c->x, c->y))
+					sweep_pockets(c->x, c->y, c->z);
+	}
+
+	//only sectors with threats can have anything to mark, so skip the empty and full ones
+	void mark_plane(int z){
+		for(int y = 0; y < FIELD; y++){
+			for(int x = 0; x < FIELD; x++){
+				if(!planes[z]->live(x, y)){
+					x |= SECTOR_W - 1;
+					continue;
+				}
+				planes[z]->mark(x, y);
+			}
+		}
+	}
+
+	void find_marked(int z, vector<Coord3i> & marked){
+		for(int y = 0; y < FIELD; y++){
+			for(int x = 0; x < FIELD; x++){
+				if(!planes[z]->live(x, y)){
+					x |= SECTOR_W - 1;
+					continue;
+				}
+				if(planes[z]->marked(x, y))
+					marked.push_back(Coord3i(x, y, z));
+			}
+		}
 	}
 
 	//reset all reachable MARK threats to real THREATs
-	void unmark(int x, int y, int z){
-		queue<Coord3i> q;
+	//breadth first a level at a time, with each level's frontier split across the workers
+	void unmark(Worker * worker, int x, int y, int z){
+		const unsigned int chunk = 1024;
 
-		q.push(Coord3i(x, y, z));
+		vector<Coord3i> frontier;
+		vector< vector<Coord3i> > next;
 
-		Coord3i c;
-		while(!q.empty()){
-			c = q.front();
-			q.pop();
+		fix_period(x, y);
+		if(z >= zmin && z < zmax && planes[z]->unmark(x, y)){
+			frontier.push_back(Coord3i(x, y, z));
+			surfacethreats++;
+		}
 
-			if(c.z < zmin || c.z >= zmax)
-				continue;
+		while(!frontier.empty()){
+			next.resize((frontier.size() + chunk - 1) / chunk);
 
-			fix_period(c.x, c.y);
+			for(unsigned int i = 0; i < next.size(); i++){
+				next[i].clear();
+				const Coord3i * begin = & frontier[0] + i*chunk;
+				const Coord3i * end   = & frontier[0] + min((i+1)*chunk, (unsigned int)frontier.size());
+				worker->add(new UnmarkReq(this, begin, end, & next[i]));
+			}
+			surfacethreats += worker->wait();
+
+			frontier.clear();
+			for(unsigned int i = 0; i < next.size(); i++)
+				frontier.insert(frontier.end(), next[i].begin(), next[i].end());
+		}
+	}
 
-			if(planes[c.z]->unmark(c.x, c.y)){
-				surfacethreats++;
+	//unmark the neighbours of this part of the frontier, the ones that were marked make up the next frontier
+	//unmark is atomic, so each point ends up in exactly one of the next frontiers
+	int unmark_frontier(const Coord3i * begin, const Coord3i * end, vector<Coord3i> & next){
+		static const int dirs[6][3] = {{-1,0,0}, {1,0,0}, {0,-1,0}, {0,1,0}, {0,0,-1}, {0,0,1}};
 
-				q.push(Coord3i(c.x-1, c.y, c.z));
-				q.push(Coord3i(c.x+1, c.y, c.z));
-				q.push(Coord3i(c.x, c.y-1, c.z));
-				q.push(Coord3i(c.x, c.y+1, c.z));
-				q.push(Coord3i(c.x, c.y, c.z-1));
-				q.push(Coord3i(c.x, c.y, c.z+1));
+		int count = 0;
+		for(const Coord3i * c = begin; c != end; ++c){
+			for(int i = 0; i < 6; i++){
+				Coord3i n(c->x + dirs[i][0], c->y + dirs[i][1], c->z + dirs[i][2]);
+
+				if(n.z < zmin || n.z >= zmax)
+					continue;
+
+				fix_period(n.x, n.y);
+
+				if(planes[n.z]->unmark(n.x, n.y)){
+					next.push_back(n);
+					count++;
+				}
 			}
 		}
+		return count;
 	}
 
 	void sweep_pockets(int x, int y, int z){
@@ -467,9 +864,132 @@ public:
 		}
 	}
 
+	//empty space that a pocket could be made of, anything above the window is open
+	bool open_space(int x, int y, int z) const {
+		if(z < zmin)
+			return false;
+		if(z >= zmax)
+			return true;
+		uint16_t grain = get_grain(x, y, z);
+		return (grain == 0 || grain == THREAT);
+	}
+
+	//check whether the open space around X,Y,Z is still connected within the 3x3x3 cube around it
+	//if it is, taking this point can't have closed off a pocket, otherwise it might have
+	bool splits_space(int X, int Y, int Z) const {
+		static const int faces[6] = {4, 10, 12, 14, 16, 22}; //the cube indexes of the 6 face neighbours
+
+		bool open[27], seen[27];
+		for(int i = 0; i < 27; i++){
+			open[i] = (i != 13 && open_space(X + i%3 - 1, Y + (i/3)%3 - 1, Z + i/9 - 1));
+			seen[i] = false;
+		}
+
+		int start = -1;
+		for(int f = 0; f < 6 && start == -1; f++)
+			if(open[faces[f]])
+				start = faces[f];
+
+		if(start == -1)
+			return false;
+
+		int stack[27], top = 0;
+		stack[top++] = start;
+		seen[start] = true;
+
+		while(top){
+			int i = stack[--top];
+			int n[6], num = 0;
+			if(i % 3 > 0)     n[num++] = i - 1;
+			if(i % 3 < 2)     n[num++] = i + 1;
+			if(i / 3 % 3 > 0) n[num++] = i - 3;
+			if(i / 3 % 3 < 2) n[num++] = i + 3;
+			if(i / 9 > 0)     n[num++] = i - 9;
+			if(i / 9 < 2)     n[num++] = i + 9;
+
+			for(int j = 0; j < num; j++){
+				if(open[n[j]] && !seen[n[j]]){
+					seen[n[j]] = true;
+					stack[top++] = n[j];
+				}
+			}
+		}
+
+		for(int f = 0; f < 6; f++)
+			if(open[faces[f]] && !seen[faces[f]])
+				return true;
+
+		return false;
+	}
+
+	//check the open space around all the recorded closures, filling any that were closed off
+	void close_pockets(){
+		static const int dirs[6][3] = {{-1,0,0}, {1,0,0}, {0,-1,0}, {0,1,0}, {0,0,-1}, {0,0,1}};
+
+		for(vector<Coord3i>::iterator c = closures.begin(); c != closures.end(); ++c)
+			for(int i = 0; i < 6; i++)
+				if(open_space(c->x + dirs[i][0], c->y + dirs[i][1], c->z + dirs[i][2]))
+					fill_pocket(c->x + dirs[i][0], c->y + dirs[i][1], c->z + dirs[i][2]);
+
+		closures.clear();
+	}
+
+	//flood the open space from x,y,z. If it never makes it above the surface it's a pocket, so fill it
+	//threats become TPOCKET, empty space becomes POCKET. Gives up if it gets too big, leaving it to pocketsearch
+	bool fill_pocket(int x, int y, int z){
+		static const int dirs[6][3] = {{-1,0,0}, {1,0,0}, {0,-1,0}, {0,1,0}, {0,0,-1}, {0,0,1}};
+
+		set<int64_t> seen;
+		vector<Coord3i> pocket;
+
+		fix_period(x, y);
+		pocket.push_back(Coord3i(x, y, z));
+		seen.insert(((int64_t)z*FIELD + y)*FIELD + x);
+
+		for(unsigned int i = 0; i < pocket.size(); i++){
+			Coord3i c = pocket[i];
+
+			if(c.z > heights[c.y][c.x]) //above the top of this column, so open to the sky
+				return false;
+
+			if((int)pocket.size() > pocket_limit){
+				pocket_overflow = true;
+				return false;
+			}
+
+			for(int j = 0; j < 6; j++){
+				Coord3i n(c.x + dirs[j][0], c.y + dirs[j][1], c.z + dirs[j][2]);
+				fix_period(n.x, n.y);
+
+				if(!open_space(n.x, n.y, n.z))
+					continue;
+
+				if(n.z >= zmax)
+					return false;
+
+				if(seen.insert(((int64_t)n.z*FIELD + n.y)*FIELD + n.x).second)
+					pocket.push_back(n);
+			}
+		}
+
+		for(vector<Coord3i>::iterator c = pocket.begin(); c != pocket.end(); ++c){
+			Point * p = planes[c->z]->get(c->x, c->y);
+			Point n;
+			if(p->grain == THREAT){
+				n = *p;
+				n.grain = TPOCKET;
+			}else{
+				n.grain = POCKET;
+			}
+			planes[c->z]->set(c->x, c->y, n);
+		}
+
+		return true;
+	}
+
 	//dump full or inactive planes off the bottom, output layer based data
-	void cleangrid(int t, vector<Grain> & grains){
-		if(opts.isomorphic) //don't want to drop any layers for isomorphic
+	void cleangrid(Worker * worker, int t, vector<Grain> & grains){
+		if(opts.isomorphic) //the voxel view traces the whole volume, so don't drop any layers
 			return;
 
 		int minheight = heights[0][0];
@@ -478,22 +998,24 @@ public:
 				if(minheight > heights[y][x])
 					minheight = heights[y][x];
 
-	//mark all pockets as such
-		if(minheight > 0 && (opts.savemem || opts.datadump))
-			pocketsearch();
+	//mark all pockets as such, with --pockets they're found as they close off, so only if that gave up or as a backstop
+		if(minheight > 0 && (opts.savemem || opts.datadump) && (!opts.pockets || pocket_overflow || t % pocket_backstop == 0))
+			pocketsearch(worker);
 
 	//drop each sector that is completely surrounded by full or dropped sectors
 		if(opts.savemem){
+			int dxs = (SECTORS_X > 1); //rows have no neighbours along x
 			for(int z = zmin; z < zmax - 5; z++){
-				for(int y = 0; y < FIELD; y++){
-					if(planes[z]->grid[y].full()){
+				for(int s = 0; s < SECTORS_X*SECTORS_Y; s++){
+					if(planes[z]->grid[s].full()){
 						bool full = true;
 						for(int Z = max(zmin, z - 1); Z <= z + 1; Z++)
-							for(int Y = y - 1; Y <= y + 1; Y++)
-								if(!planes[Z]->grid[(Y + FIELD) % FIELD].full())
-									full = false;
+							for(int dy = -1; dy <= 1; dy++)
+								for(int dx = -dxs; dx <= dxs; dx++)
+									if(!planes[Z]->grid[Plane::neighbour(s, dx, dy)].full())
+										full = false;
 						if(full)
-							planes[z]->dump(z, y);
+							planes[z]->dump(z, s);
 					}
 				}
 			}
@@ -502,17 +1024,23 @@ public:
 	//find new zmin
 		int newmin = zmin;
 		for(int i = minheight; i >= zmin; i--){
-			if(planes[i]->taken == FIELD*FIELD || planes[i]->time + 25 < t){
+			bool done;
+			if(slabs) //heights are shared, so every slab checks the same planes
+				done = slabs->min(planes[i]->count(ybegin, yend) == (yend - ybegin)*FIELD || planes[i]->time + 25 < t);
+			else
+				done = (planes[i]->taken == FIELD*FIELD || planes[i]->time + 25 < t);
+
+			if(done){
 				newmin = i;
 				break;
 			}
 		}
 
 	//dump all planes under newmin
-		dump(grains, newmin);
+		dump(worker, grains, newmin);
 	}
 
-	void dump(vector<Grain> & grains, int max = -1){
+	void dump(Worker * worker, vector<Grain> & grains, int max = -1){
 		if(max == -1)
 			max = zmax;
 
@@ -523,6 +1051,8 @@ public:
 				planes[i]->layermap(i, grains);
 			if(opts.layerstats)
 				planes[i]->layerstats(i, grains.size());
+			for(unsigned int p = 0; p < plugins.size(); p++)
+				plugins[p]->layer(worker, i, planes[i], grains);
 			if(opts.datadump)
 				planes[i]->dump(i);
 
@@ -600,7 +1130,31 @@ public:
 	}
 
 	void set_diffprob(int x, int y, int z, uint8_t prob){
-//		get_point(x, y, z)->diffprob = prob;
+		get_point(x, y, z)->diffprob = prob;
+	}
+
+	//the top of a column of this slab went from grain from to grain to at time t, 0 or a special value for none.
+	//Every grain starts on top of its own seed at time 1, so only later returns are events
+	void move_surface(int X, int Y, int from, int to, int t){
+		if(surface.empty() || Y < ybegin || Y >= yend || from == to)
+			return;
+
+		if(from && from < MAXGRAIN && ADD(surface[from], -1) == 0){
+			ADD(alive, -1);
+			if(opts.events)
+				add_event(SurfaceEvent(t, from, to, true));
+		}
+		if(to && to < MAXGRAIN && INCR(surface[to]) == 1){
+			INCR(alive);
+			if(opts.events && t > 1)
+				add_event(SurfaceEvent(t, to, from, false));
+		}
+	}
+
+	void add_event(const SurfaceEvent & e){
+		pthread_mutex_lock(&events_lock);
+		events.push_back(e);
+		pthread_mutex_unlock(&events_lock);
 	}
 
 	void set_point(int X, int Y, int Z, uint16_t time, uint16_t grain, uint8_t face){
@@ -611,11 +1165,26 @@ public:
 
 		set_point(X, Y, Z, p);
 
+		if(slabs && (Y == ybegin || Y == yend - 1)){
+			pthread_mutex_lock(&edges_lock);
+			edges.push_back(EdgePoint(X, Y, Z, p));
+			pthread_mutex_unlock(&edges_lock);
+		}
+
+		//the top of the column moves up from the point below curtop. Only the CAS that raises it gets to move the
+		//surface counts, and an empty column is 0, so its first point raises it like any other
+		int curtop = tops[Y][X];
+		while(curtop <= Z){
+			if(CAS(tops[Y][X], curtop, Z + 1)){
+				move_surface(X, Y, (curtop ? get_grain(X, Y, curtop - 1) : 0), grain, time);
+				break;
+			}
+			curtop = tops[Y][X];
+		}
+
 		int curval = heights[Y][X];
-		while(curval < Z){
-			CASv(heights[Y][X], curval, Z);
+		while(curval < Z && !CAS(heights[Y][X], curval, Z))
 			curval = heights[Y][X];
-		}
 
 		int Xmin = X - 1, Xmax = X + 1;
 		int Ymin = Y - 1, Ymax = Y + 1;
@@ -626,6 +1195,12 @@ public:
 				for(int x = Xmin; x <= Xmax; x++)
 					if(x != X || y != Y || z != Z)
 						set_threat(x, y, z, time);
+
+		if(opts.pockets && splits_space(X, Y, Z)){
+			pthread_mutex_lock(&closures_lock);
+			closures.push_back(Coord3i(X, Y, Z));
+			pthread_mutex_unlock(&closures_lock);
+		}
 	}
 
 	//given a point, return a list of nearby grains. Fill the supplied array, returning the number of entries filled.
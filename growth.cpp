@@ -3,6 +3,7 @@
 #include "coord.h"
 #include "ray.h"
 #include "worker.h"
+#include "sobol.h"
 
 #include "stats.h"
 
@@ -16,34 +17,97 @@ int time_msec(){
 	return (time.tv_sec*1000 + time.tv_usec/1000);
 }
 
+//fixed point flux credited to a fully open column, smaller for fields past 1024 so FIELD*FIELD of these still fit
+//in a face's int flux
+#define HORIZON_UNIT (FIELD <= 1024 ? 1024 : (1 << 30) / (FIELD*FIELD))
+#if (1 << 30) / FIELD / FIELD < 1
+#error FIELD is too big for the horizon flux to fit in an int
+#endif
+
 class Growth {
 	struct CountThreatsReq : WorkRequest {
 		Growth * g;
-		int z;
-		CountThreatsReq(Growth * G, int Z) : g(G), z(Z) { }
+		int z, y1, y2;
+		CountThreatsReq(Growth * G, int Z, int Y1, int Y2) : g(G), z(Z), y1(Y1), y2(Y2) { }
 		int64_t run(){
-			g->count_threats(z);
+			g->count_threats(z, y1, y2);
 			return 0;
 		}
 	};
 
 	struct AddFluxReq : WorkRequest {
 		Growth * g;
-		int z;
-		AddFluxReq(Growth * G, int Z) : g(G), z(Z) { }
+		int start, num, y1, y2;
+		AddFluxReq(Growth * G, int S, int N, int Y1, int Y2) : g(G), start(S), num(N), y1(Y1), y2(Y2) { }
+		int64_t run(){
+			return g->addflux(start, num, y1, y2);
+		}
+	};
+
+	//a ray or substrate walk passed on to the slab it crossed into, at a point that slab hasn't checked yet
+	struct Handoff {
+		Ray ray;
+		bool walk;
+	};
+
+	struct HandoffReq : WorkRequest {
+		Growth * g;
+		const vector<Handoff> * handoffs;
+		int start, num;
+		HandoffReq(Growth * G, const vector<Handoff> * H, int S, int N) : g(G), handoffs(H), start(S), num(N) { }
+		int64_t run(){
+			int64_t landed = 0;
+			for(int i = start; i < start + num; i++)
+				landed += g->shoot((*handoffs)[i].ray, (*handoffs)[i].walk);
+			return landed;
+		}
+	};
+
+	struct HorizonReq : WorkRequest {
+		Growth * g;
+		int family, line;
+		HorizonReq(Growth * G, int F, int L) : g(G), family(F), line(L) { }
+		int64_t run(){
+			g->horizon_line(family, line);
+			return 0;
+		}
+	};
+
+	struct HorizonFluxReq : WorkRequest {
+		Growth * g;
+		int y;
+		HorizonFluxReq(Growth * G, int Y) : g(G), y(Y) { }
+		int64_t run(){
+			return g->horizon_flux(y);
+		}
+	};
+
+	struct SubstrateDistReq : WorkRequest {
+		Growth * g;
+		int pass, line;
+		SubstrateDistReq(Growth * G, int P, int L) : g(G), pass(P), line(L) { }
 		int64_t run(){
-			g->addflux(z);
+			g->substrate_dist_line(pass, line);
 			return 0;
 		}
 	};
 
 	struct RunLayerReq : WorkRequest {
 		Growth * g;
-		int z, t;
-		bool n;
-		RunLayerReq(Growth * G, int Z, int T, bool N) : g(G), z(Z), t(T), n(N) { }
+		int z, t, y1, y2;
+		RunLayerReq(Growth * G, int Z, int T, int Y1, int Y2) : g(G), z(Z), t(T), y1(Y1), y2(Y2) { }
+		int64_t run(){
+			return g->run_layer(z, t, y1, y2);
+		}
+	};
+
+	struct RunFrontierReq : WorkRequest {
+		Growth * g;
+		const vector< vector<int> > * last;
+		int z, t, y1, y2;
+		RunFrontierReq(Growth * G, const vector< vector<int> > * L, int Z, int T, int Y1, int Y2) : g(G), last(L), z(Z), t(T), y1(Y1), y2(Y2) { }
 		int64_t run(){
-			return g->run_layer(z, t, n);
+			return g->run_frontier(*last, z, t, y1, y2);
 		}
 	};
 
@@ -52,6 +116,9 @@ public:
 
 	int num_steps;
 	double growth_factor;
+	double adaptive; //with adaptive steps, the most any face may advance in a step, in points, otherwise 0
+	double elapsed;  //growth so far, in steps of growth factor 1
+	double last_factor;
 	int max_memory;
 	int end_grains;
 
@@ -60,22 +127,51 @@ public:
 	double ray_angle;
 	double ray_cutoff;
 	double start_angle;
+	bool horizon;
+	bool sobol;
+	bool jumprays;
 
 	bool substrate_diffusion;
 	double diffusion_probability;
+	bool facewalk;
 
 	vector<Grain> grains;
 	Grid * grid;
 
 	Worker * worker;
 	int num_threads;
+	const Nodes * nodes; //with --numa, the nodes each band of rows is grown on, otherwise NULL
+	int bands;           //one band of rows per node
+
+	float (*visible)[FIELD]; //fraction of the flux that reaches each column, from the horizon sweeps
+	float (*substrate)[FIELD]; //distance from each substrate point to the nearest threat on the substrate
+	bool substrate_jumps;      //whether substrate is up to date for this step
+
+	Sobol sobolseq;
+	double sobolshift[4]; //random shift of the sequence, new each step
 
-	Growth(int threads){
+	//points grown by the current growth pass, as y*FIELD+x for each plane. Only the threats next to them can
+	//change in the next pass, so that pass checks just those
+	vector< vector<int> > grown;
+	pthread_mutex_t grown_lock;
+
+	int remain; //grains still on the surface as of the last step
+
+	Slabs * slabs; //with --slabs, the other processes sharing the run, otherwise NULL
+	vector< vector<Handoff> > handoff; //rays and substrate walks to pass on to each other slab
+	pthread_mutex_t handoff_lock;
+
+	Growth(int threads, const Nodes * n = NULL){
 		max_memory = 0;
 		num_threads = threads;
+		nodes = n;
+		bands = (nodes ? nodes->num() : 1);
 
 		num_steps = 200;
 		growth_factor = 1;
+		adaptive = 0;
+		elapsed = 0;
+		last_factor = 0;
 		end_grains = 20;
 
 		start_angle = 0;
@@ -83,27 +179,66 @@ public:
 		ray_ratio = 1.0;
 		ray_angle = 0;
 		ray_cutoff = 85;
+		horizon = false;
+		sobol = false;
+		jumprays = false;
+		visible = NULL;
+		substrate = NULL;
+		substrate_jumps = false;
+		remain = 0;
+		slabs = NULL;
+		pthread_mutex_init(&handoff_lock, NULL);
+		pthread_mutex_init(&grown_lock, NULL);
 	
 		diffusion_probability = 0.95;
 		substrate_diffusion = true;
+		facewalk = false;
 
 		grid = new Grid;
 
 		//define a blank grain
 		grains.push_back(Grain());
 
-		worker = new Worker(num_threads);
+		worker = new Worker(num_threads, nodes);
+
+		//every band reads the heights and flux, so no node should hold all of them
+		if(nodes){
+			nodes->interleave(grid->tops, sizeof(grid->tops));
+			nodes->interleave(grid->heights, sizeof(grid->heights));
+			nodes->interleave(grid->flux, sizeof(grid->flux));
+		}
 	}
 
 	~Growth(){
+		if(visible)
+			delete[] visible;
+		if(substrate)
+			delete[] substrate;
 		delete grid;
 		delete worker;
 	}
 
-	void init(int num_grains, double min_space, Shape & shape, bool load){
+	//first row of band b, on sector boundaries so no sector is shared between nodes
+	int band(int b){
+		return grid->ybegin + ((grid->yend - grid->ybegin)/SECTOR_H * b / bands) * SECTOR_H;
+	}
+
+	//grow only this process's slab of the field, see Slabs
+	void set_slabs(Slabs * s){
+		slabs = s;
+		grid->set_slabs(s);
+		handoff.resize(s->num);
+	}
+
+	//start the run with num_grains grains of shape. They're placed here, or read from grains.csv with load,
+	//unless placed gives the positions and rotations to use, as from place_grains
+	void init(int num_grains, double min_space, const Shape & shape, bool load, const vector<Grain> * placed = NULL){
 		int starttime = time_msec();
 
-		echo("Initializing %d grains of shape %s, to be run %d times in %.2f increments ... ", num_grains, shape.name, num_steps, growth_factor);
+		if(adaptive)
+			echo("Initializing %d grains of shape %s, to be grown as far as %d steps of %.2f, advancing at most %.2f a step ... ", num_grains, shape.name, num_steps, growth_factor, adaptive);
+		else
+			echo("Initializing %d grains of shape %s, to be run %d times in %.2f increments ... ", num_grains, shape.name, num_steps, growth_factor);
 		fflush(stdout);
 
 		FILE * fd = NULL;
@@ -118,25 +253,83 @@ public:
 			fprintf(fd, "time,num grains,mean height,rms roughness\n");
 			fclose(fd);
 		}
+		if(adaptive){
+			fd = fopen("steps.csv", "w");
+			fprintf(fd, "step,factor,time,max advance\n");
+			fclose(fd);
+		}
+		if(opts.events){
+			fd = fopen("events.csv", "w");
+			fprintf(fd, "time,grain,event,other grain\n");
+			fclose(fd);
+		}
 
-		Stats::timestats(0, grid, grains);
-		grid->cleangrid(0, grains);
+		if(opts.timestats)
+			Stats::timestats(0, grid, grains);
+		grid->cleangrid(worker, 0, grains);
 		
+		//grain number 0 is special as non-existent
+		if(placed)
+			grains = *placed;
+		else
+			place_grains(grains, num_grains, min_space, start_angle, load);
+
+		grid->surface.assign(grains.size(), 0);
+
+		for(unsigned int i = 1; i < grains.size(); i++){
+			Grain & g = grains[i];
+			g.add_faces(shape.faces, shape.num_faces);
+			g.rotate(g.theta1, g.theta2, g.phi);
+
+			if(grid->owns(g.x, g.y))
+				grid->set_point(g.x, g.y, 0, 1, i, 0);
+		}
+
+		if(slabs){
+			grid->exchange_edges();
+			grid->gather_heights();
+		}
+
+		//shared placements are written out once for the whole batch
+		if(!placed && !load && opts.graininit)
+			write_grains(grains);
+
+		if(!placed && opts.voronei){
+			echo("Finding closest grains ... ");
+			fflush(stdout);
+			Stats::voroneimap(grains);
+		}
+
+		remain = grains.size() - 1;
+
+		if(opts.timestats)
+			Stats::timestats(1, grid, grains);
+		grid->cleangrid(worker, 1, grains);
+
+		echo("done in %d msec\n", time_msec() - starttime);
+	}
+
+	//append num_grains grains to grains with their positions, rotations and colours but no faces yet, either spread
+	//at least min_space apart or read from grains.csv with load
+	static void place_grains(vector<Grain> & grains, int num_grains, double min_space, double start_angle, bool load){
 		double min_space_squared = min_space*min_space;
 
+		FILE * fd = NULL;
 		if(load){
 			fd = fopen("grains.csv", "r");
+			if(!fd){
+				printf("Couldn't open grains.csv\n");
+				exit(1);
+			}
 			char buf[100];
 			if(fgets(buf, 99, fd)); //ignore the header
 		}
 
-	//generate initial grain information
-	//grain number 0 is special as non-existent
 		for(int i = 1; i <= num_grains; i++){
 			Grain g;
-			
+
 			if(load){
-				g.load(fd, shape.faces, shape.num_faces);
+				g.load(fd, NULL, 0);
 			}else{
 				double dist = FIELD*FIELD;
 
@@ -151,8 +344,6 @@ public:
 					}
 				}while(dist < min_space_squared);
 
-				g.add_faces(shape.faces, shape.num_faces);
-
 				g.rotate(2.0*M_PI*unitrand(), 2.0*M_PI*unitrand(), acos(pow(unitrand(), 1.0/(1.0 + start_angle))));
 			}
 
@@ -161,149 +352,306 @@ public:
 			else
 				g.directional_color();
 
-			grid->set_point(g.x, g.y, 0, 1, i, 0);
 			grains.push_back(g);
 		}
 
 		if(load)
 			fclose(fd);
+	}
 
-		if(!load && opts.graininit){
-			fd = fopen("grains.csv", "w");
-			fprintf(fd, "grain,x,y,theta1,theta2,phi\n");
-			for(int i = 1; i <= num_grains; i++)
-				grains[i].dump(fd, i);
-			fclose(fd);
-		}
+	static void write_grains(vector<Grain> & grains){
+		FILE * fd = fopen("grains.csv", "w");
+		fprintf(fd, "grain,x,y,theta1,theta2,phi\n");
+		for(unsigned int i = 1; i < grains.size(); i++)
+			grains[i].dump(fd, i);
+		fclose(fd);
+	}
 
-		if(opts.voronei){
-			echo("Finding closest grains ... ");
-			fflush(stdout);
-			Stats::voroneimap(grains);
+	//run timestep t, returns false if the run should stop after it
+	bool step(int t){
+		int starttime;
+
+		echo("Step %d, layers %d-%d, %d grains, %d Mb ... ", t, grid->zmin, grid->zmax, remain, grid->memory_usage()/(1024*1024));
+		fflush(stdout);
+
+		starttime = time_msec();
+
+	//reset grain and face stats
+		for(unsigned int i = 0; i < grains.size(); i++){
+			grains[i].growth = 0;
+			grains[i].threats = 0;
+
+			for(unsigned int j = 0; j < grains[i].faces.size(); j++){
+				Face * face = &(grains[i].faces[j]);
+				face->growth = 0;
+				face->threats = 0;
+				face->flux = 0;
+			}
 		}
 
-		Stats::timestats(1, grid, grains);
-		grid->cleangrid(1, grains);
+		if(opts.fluxdump)
+			grid->resetflux();
 
-		echo("done in %d msec\n", time_msec() - starttime);
-	}
+		int growth = 0;
+		int raycount = (grid->zmin == 0 ? grid->planes[0]->taken : FIELD*FIELD);
+		if(slabs) //only this slab's share
+			raycount = (grid->zmin == 0 ? grid->planes[0]->count(grid->ybegin, grid->yend) : (grid->yend - grid->ybegin)*FIELD);
+		raycount *= ray_ratio;
+
+		//grow the grains, evenly until the rays start. Adaptive steps start them after the same growth as fixed ones
+		bool even = (adaptive ? elapsed < (ray_step - 1) * growth_factor - 1e-9 : t <= ray_step);
+		double factor, rate = 0;
+		if(ray_step == 0 || even){
+			for(unsigned int i = 0; i < grains.size(); i++)
+				for(unsigned int j = 0; j < grains[i].faces.size(); j++)
+					rate = max(rate, grains[i].faces[j].speed());
+
+			factor = step_factor(rate);
+			for(unsigned int i = 0; i < grains.size(); i++)
+				grains[i].grow_faces(factor);
+		}else{
+			for(int z = grid->zmin; z < grid->zmax; z++)
+				for(int b = 0; b < bands; b++)
+					worker->add(new CountThreatsReq(this, z, band(b), band(b+1)), b);
+
+			worker->wait();
+
+			if(slabs){
+				slab_sum(&Grain::threats);
+				slab_sum(&Face::threats);
+			}
 
-	void run(){
-		int start = time_msec();
-		int starttime;
-		int remain = grains.size() - 1;
+			substrate_jumps = (substrate_diffusion && grid->zmin == 0 && !slabs); //the distances stop at the slab edges
+			if(substrate_jumps)
+				substrate_distances();
 
-		for(int t = 2; t <= num_steps && !opts.interrupt; t++){
-			echo("Step %d, layers %d-%d, %d grains, %d Mb ... ", t, grid->zmin, grid->zmax, remain, grid->memory_usage()/(1024*1024));
-			fflush(stdout);
+			double fluxunit = ray_ratio;
+			if(horizon){
+				fluxunit = add_horizon_flux(raycount / ray_ratio);
+			}else{
+				if(sobol)
+					for(int d = 0; d < 4; d++)
+						sobolshift[d] = unitrand();
+
+				if(jumprays)
+					grid->build_threat_dist(worker);
+
+				//each band shoots its share of the rays from above its own rows
+				for(int b = 0; b < bands; b++){
+					int first = (int64_t)raycount * (band(b)   - grid->ybegin) / (grid->yend - grid->ybegin);
+					int last  = (int64_t)raycount * (band(b+1) - grid->ybegin) / (grid->yend - grid->ybegin);
+					for(int start = first; start < last; start += 1000)
+						worker->add(new AddFluxReq(this, start, min(last - start, 1000), band(b), band(b+1)), b);
+				}
 
-			starttime = time_msec();
+			//rays that hit nothing aren't shot again, instead scale up the ones that landed
+				int64_t landed = worker->wait();
 
-		//reset grain and face stats
-			for(unsigned int i = 0; i < grains.size(); i++){
-				grains[i].growth = 0;
-				grains[i].threats = 0;
+				if(slabs){
+					landed += handoff_rays();
+					landed = slabs->sum(landed);
+					raycount = slabs->sum(raycount);
+					slab_sum(&Face::flux);
+				}
+
+				if(landed)
+					fluxunit *= (double)landed / raycount;
+			}
+
+		//add flux, the flux sums are the same on every slab so they all pick the same factor
+			for(unsigned int i = 0; i < grains.size(); i++)
+				for(unsigned int j = 0; j < grains[i].faces.size(); j++)
+					rate = max(rate, grains[i].faces[j].speed() * grains[i].faces[j].fluxamnt() / fluxunit);
 
+			factor = step_factor(rate);
+			for(unsigned int i = 0; i < grains.size(); i++){
 				for(unsigned int j = 0; j < grains[i].faces.size(); j++){
 					Face * face = &(grains[i].faces[j]);
-					face->growth = 0;
-					face->threats = 0;
-					face->flux = 0;
+					double amnt = face->fluxamnt();
+					face->grow(factor * amnt / fluxunit);
 				}
 			}
+		}
+		elapsed += factor;
+
+		if(adaptive){
+			echo("factor %.3f ... ", factor);
+			if(!slabs || !slabs->rank){
+				FILE * fd = fopen("steps.csv", "a");
+				fprintf(fd, "%d,%f,%f,%f\n", t, factor, elapsed, factor * rate);
+				fclose(fd);
+			}
+		}
 
-			if(opts.fluxdump)
-				grid->resetflux();
-
-			int growth = 0;
-			int raycount = (grid->zmin == 0 ? grid->planes[0]->taken : FIELD*FIELD);
-			raycount *= ray_ratio;
+		echo("added flux in %d msec ... ", time_msec() - starttime);
+		fflush(stdout);
 
-			//grow the grains
-			if(ray_step == 0 || t <= ray_step){
-				for(unsigned int i = 0; i < grains.size(); i++)
-					grains[i].grow_faces(growth_factor);
-			}else{
-				for(int z = grid->zmin; z < grid->zmax; z++)
-					worker->add(new CountThreatsReq(this, z));
 
-				worker->wait();
+		starttime = time_msec();
 
-				while(raycount > 0){
-					worker->add(new AddFluxReq(this, min(raycount, 1000)));
-					raycount -= 1000;
+		//fill in the controller of the point if there is a new one. The first pass checks every threat,
+		//the rest only those next to points grown by the pass before, until a pass grows nothing
+		int thisgrowth;
+		int count = 0;
+		bool mem = true;
+		do{
+			vector< vector<int> > last;
+			last.swap(grown);
+			grown.resize(grid->zmax);
+
+			for(int z = grid->zmin; z < grid->zmax; z++){
+				for(int b = 0; b < bands; b++){
+					if(count == 0)
+						worker->add(new RunLayerReq(this, z, t, band(b), band(b+1)), b);
+					else
+						worker->add(new RunFrontierReq(this, &last, z, t, band(b), band(b+1)), b);
 				}
+			}
 
-				worker->wait();
+			thisgrowth = worker->wait();
 
-			//add flux
-				for(unsigned int i = 0; i < grains.size(); i++){
-					for(unsigned int j = 0; j < grains[i].faces.size(); j++){
-						Face * face = &(grains[i].faces[j]);
-						double amnt = face->fluxamnt();
-						face->grow(growth_factor * amnt / ray_ratio);
-					}
-				}
+			if(slabs){
+				vector<EdgePoint> mirrored; //their neighbours on this slab's rows are threats to check too
+				grid->exchange_edges(&mirrored);
+				for(unsigned int i = 0; i < mirrored.size(); i++)
+					grown[mirrored[i].z].push_back(mirrored[i].y*FIELD + mirrored[i].x);
+				thisgrowth = slabs->sum(thisgrowth);
 			}
 
-			echo("added flux in %d msec ... ", time_msec() - starttime);
-			fflush(stdout);
+			mem = grid->growgrid();
+			if(slabs)
+				mem = slabs->min(mem);
 
+			growth += thisgrowth;
+			count++;
+		}while(mem && thisgrowth);
+		grown.clear();
 
-			starttime = time_msec();
+		if(opts.pockets)
+			grid->close_pockets();
 
-			//fill in the controller of the point if there is a new one
-			int thisgrowth;
-			int count = 0;
-			bool mem = true;
-			do{
-				for(int z = grid->zmin; z < grid->zmax; z++)
-					worker->add(new RunLayerReq(this, z, t, count));
+		if(slabs){
+			vector<int> mine(grains.size());
+			for(unsigned int i = 0; i < grains.size(); i++)
+				mine[i] = grains[i].growth;
 
-				thisgrowth = worker->wait();
+			slab_sum(&Grain::growth);
+			slab_sum(&Face::growth);
 
-				mem = grid->growgrid();
+			for(unsigned int i = 0; i < grains.size(); i++)
+				grains[i].size += grains[i].growth - mine[i];
 
-				growth += thisgrowth;
-				count++;
-			}while(mem && count < 5 && thisgrowth && thisgrowth > growth/1000.0);
+			grid->gather_heights();
+		}
 
 
-			echo("grew %d points in %d runs in %d msec ... ", growth, count, time_msec() - starttime);
-			fflush(stdout);
+		echo("grew %d points in %d runs in %d msec ... ", growth, count, time_msec() - starttime);
+		fflush(stdout);
 
 
-			starttime = time_msec();
+		starttime = time_msec();
 
-			//output and finished data and images
-			Stats::timestats(worker, t, grid, grains);
-			grid->cleangrid(t, grains);
+		//output and finished data and images
+		if(opts.events)
+			grid->write_events();
+		if(opts.peaks || opts.tracks) //found once for both
+			Stats::find_peaks(worker, grid, grains.size(), grid->peaks);
+		Stats::timestats(worker, t, grid, grains);
+		for(unsigned int i = 0; i < grid->plugins.size(); i++)
+			grid->plugins[i]->step(worker, t, grid, grains);
+		grid->cleangrid(worker, t, grains);
 
-			echo("output in %d msec\n", time_msec() - starttime);
+		echo("output in %d msec\n", time_msec() - starttime);
 
-			if(!mem){
-				echo("Couldn't allocate more memory, current usage ~ %d Mb\n", grid->memory_usage()/(1024*1024));
-				break;
-			}
+		if(!mem){
+			echo("Couldn't allocate more memory, current usage ~ %d Mb\n", grid->memory_usage()/(1024*1024));
+			return false;
+		}
 
-			remain = grid->graincount(grains.size());
-			if(remain <= end_grains){
-				echo("Hit the grain limit: %d grains left\n", remain);
-				break;
-			}
-			
-			if(max_memory && grid->memory_usage()/(1024*1024) > max_memory){
-				echo("Hit the memory limit: %d Mb\n", max_memory);
-				break;
-			}
+		if(adaptive && elapsed >= (num_steps - 1) * growth_factor - 1e-9){
+			echo("Grew as far as %d steps of %.2f in %d steps\n", num_steps, growth_factor, t);
+			return false;
+		}
+
+		remain = grid->graincount();
+		if(remain <= end_grains){
+			echo("Hit the grain limit: %d grains left\n", remain);
+			return false;
+		}
+		
+		long memory = grid->memory_usage();
+		if(slabs) //the biggest slab
+			memory = slabs->max(memory);
+
+		if(max_memory && memory/(1024*1024) > max_memory){
+			echo("Hit the memory limit: %d Mb\n", max_memory);
+			return false;
 		}
 
-		grid->dump(grains);
-		echo("Finished in %d sec\n", (time_msec() - start)/1000);
+		return true;
+	}
+
+	//the growth factor for this step, given the fastest face moves rate points per unit of factor. Fixed without
+	//adaptive steps, otherwise as big as keeps every face within adaptive points, but no more than growth_factor or
+	//double the last, and no less than a hundredth of growth_factor so one fast face can't stall the run. The last
+	//step only grows what's left of num_steps of growth_factor
+	double step_factor(double rate){
+		if(!adaptive)
+			return growth_factor;
+
+		double f = growth_factor;
+		if(rate > 0)
+			f = min(f, adaptive / rate);
+		if(last_factor > 0)
+			f = min(f, 2*last_factor);
+		f = max(f, growth_factor / 100);
+		f = min(f, (num_steps - 1) * growth_factor - elapsed);
+
+		last_factor = f;
+		return f;
+	}
+
+	//output the layers still held, at the end of the run
+	void finish(){
+		if(opts.pockets && (opts.savemem || opts.datadump)) //catch any the backstop hasn't yet
+			grid->pocketsearch(worker);
+		grid->dump(worker, grains);
+		for(unsigned int i = 0; i < grid->plugins.size(); i++)
+			grid->plugins[i]->finish(worker);
+	}
+
+	//whether to stop early, agreed by all the slabs
+	bool interrupted(){
+		return (slabs ? slabs->max(opts.interrupt) : opts.interrupt);
 	}
 
-	void count_threats(int z){
-		for(int y = 0; y < FIELD; y++){
+	//add up a per grain or per face count over all the slabs
+	void slab_sum(int Grain::* field){
+		vector<int64_t> vals;
+		for(unsigned int i = 0; i < grains.size(); i++)
+			vals.push_back(grains[i].*field);
+
+		slabs->sum(&vals[0], vals.size());
+
+		for(unsigned int i = 0; i < grains.size(); i++)
+			grains[i].*field = vals[i];
+	}
+	void slab_sum(int Face::* field){
+		vector<int64_t> vals;
+		for(unsigned int i = 0; i < grains.size(); i++)
+			for(unsigned int j = 0; j < grains[i].faces.size(); j++)
+				vals.push_back(grains[i].faces[j].*field);
+
+		slabs->sum(&vals[0], vals.size());
+
+		int k = 0;
+		for(unsigned int i = 0; i < grains.size(); i++)
+			for(unsigned int j = 0; j < grains[i].faces.size(); j++)
+				grains[i].faces[j].*field = vals[k++];
+	}
+
+	void count_threats(int z, int y1, int y2){
+		for(int y = y1; y < y2; y++){
 			for(int x = 0; x < FIELD; x++){
 
 			//point isn't threatened
@@ -324,117 +672,468 @@ public:
 		}
 	}
 
-	int run_layer(int z, int t, bool onlynewthreats){
-		int growth = 0;
+	int run_layer(int z, int t, int y1, int y2){
+		vector<int> mine;
 
-		for(int y = 0; y < FIELD; y++){
+		for(int y = y1; y < y2; y++){
 			for(int x = 0; x < FIELD; x++){
 
 			//point isn't threatened
 				Point * p = grid->get_point(x, y, z);
 
-				if(p->grain == FULLPOINT) //skip this whole sector if it's full
-					break;
-
-				if(p->grain != THREAT || (onlynewthreats && p->time != t))
+				if(p->grain == FULLPOINT){ //skip the rest of this sector's row if it's full
+					x |= SECTOR_W - 1;
 					continue;
+				}
+
+				if(p->grain == THREAT && grow_point(x, y, z, t))
+					mine.push_back(y*FIELD + x);
+			}
+		}
 
-				uint16_t threats[27];
-				uint16_t * threats_end = grid->check_grain_threats(threats, x, y, z);
+		add_grown(z, mine);
+		return mine.size();
+	}
 
-			//check how many took this point this time step, moving valid ones down and ignoring ones that are only a threat
-				for(uint16_t * a = threats; a != threats_end; ){
-					if(grains[*a].check_point(x, y, z)){
-						a++;
-					}else{
-						threats_end--;
-						*a = *threats_end;
+	//check the threats on plane z in rows y1 to y2 that neighbour points grown by the last pass. A threat was already
+	//turned down by the grains next to it before, so it can only change if the new neighbour's grain reaches it
+	int run_frontier(const vector< vector<int> > & last, int z, int t, int y1, int y2){
+		vector<int> threats;
+		for(int Z = max(z - 1, grid->zmin); Z <= z + 1 && Z < (int)last.size(); Z++){
+			for(unsigned int i = 0; i < last[Z].size(); i++){
+				int X = last[Z][i] % FIELD, Y = last[Z][i] / FIELD;
+				const Grain & grain = grains[grid->get_grain(X, Y, Z)];
+				for(int dy = -1; dy <= 1; dy++){
+					for(int dx = -1; dx <= 1; dx++){
+						int x = X + dx, y = Y + dy;
+						grid->fix_period(x, y);
+						if(y >= y1 && y < y2 && grid->get_grain(x, y, z) == THREAT && grain.check_point(x, y, z))
+							threats.push_back(y*FIELD + x);
 					}
 				}
+			}
+		}
 
-			//no threats actually took this point
-				if(threats == threats_end)
-					continue;
+		//a threat next to several new points only needs checking once
+		sort(threats.begin(), threats.end());
+		threats.erase(unique(threats.begin(), threats.end()), threats.end());
+
+		vector<int> mine;
+		for(unsigned int i = 0; i < threats.size(); i++){
+			int x = threats[i] % FIELD, y = threats[i] / FIELD;
+			if(grid->get_grain(x, y, z) == THREAT && grow_point(x, y, z, t))
+				mine.push_back(threats[i]);
+		}
+
+		add_grown(z, mine);
+		return mine.size();
+	}
+
+	//give the threatened point x,y,z to the grain that reaches it first, if any do yet
+	bool grow_point(int x, int y, int z, int t){
+		uint16_t threats[27];
+		uint16_t * threats_end = grid->check_grain_threats(threats, x, y, z);
+
+	//check how many took this point this time step, moving valid ones down and ignoring ones that are only a threat
+		for(uint16_t * a = threats; a != threats_end; ){
+			if(grains[*a].check_point(x, y, z)){
+				a++;
+			}else{
+				threats_end--;
+				*a = *threats_end;
+			}
+		}
+
+	//no threats actually took this point
+		if(threats == threats_end)
+			return false;
+
+	//figure out which grain and face got it first
+		uint16_t best = threats[0];
+		FaceDist min_dist = grains[best].find_distance(x, y, z);
+
+		for(uint16_t * a = threats + 1; a != threats_end; a++){
+			FaceDist temp = grains[*a].find_distance(x, y, z);
+			if(temp.dist < min_dist.dist){
+				min_dist = temp;
+				best = *a;
+			}
+		}
+
+		//save this point
+		grid->set_point(x, y, z, t, best, min_dist.face);
+		INCR(grains[best].growth);
+		INCR(grains[best].size);
+		INCR(grains[best].faces[min_dist.face].growth);
+		return true;
+	}
 
-			//figure out which grain and face got it first
-				uint16_t best = threats[0];
-				FaceDist min_dist = grains[best].find_distance(x, y, z);
+	void add_grown(int z, const vector<int> & points){
+		if(points.empty())
+			return;
+		pthread_mutex_lock(&grown_lock);
+		grown[z].insert(grown[z].end(), points.begin(), points.end());
+		pthread_mutex_unlock(&grown_lock);
+	}
+
+	//deterministic flux: sweep the height field along 8 azimuths to find the horizon each column sees, then credit
+	//each column with the fraction of the ray distribution that clears it. Lines in one direction are independent,
+	//so each direction is one batch of requests. Flux blocked from one column lands on the one blocking it, so
+	//the total is kept the same as the rays would give, one per column covered. Returns the flux that counts as one ray
+	double add_horizon_flux(double columns){
+		if(!visible)
+			visible = new float[FIELD][FIELD];
+
+		for(int y = 0; y < FIELD; y++)
+			for(int x = 0; x < FIELD; x++)
+				visible[y][x] = 0;
+
+		for(int family = 0; family < 4; family++){
+			for(int line = 0; line < FIELD; line++)
+				worker->add(new HorizonReq(this, family, line));
+			worker->wait();
+		}
+
+		for(int y = 0; y < FIELD; y++)
+			worker->add(new HorizonFluxReq(this, y));
+		int64_t total = worker->wait();
 
-				for(uint16_t * a = threats + 1; a != threats_end; a++){
-					FaceDist temp = grains[*a].find_distance(x, y, z);
-					if(temp.dist < min_dist.dist){
-						min_dist = temp;
-						best = *a;
+		return (total && columns > 0 ? total / columns : HORIZON_UNIT);
+	}
+
+	//sweep one periodic line of columns both ways, keeping the upper convex hull of the columns already passed.
+	//The last hull point is the one that sets the horizon for the next column. Two laps around the line so the
+	//columns that wrap around are counted too, only the second lap is recorded.
+	//family: 0 along x, 1 along y, 2 along x=y, 3 along x=-y
+	void horizon_line(int family, int line){
+		static const int dx[4] = { 1, 0, 1, -1 };
+		static const int dy[4] = { 0, 1, 1,  1 };
+
+		double step = (family < 2 ? 1 : M_SQRT2);
+		double cutoffcos = cos(ray_cutoff * M_PI/180);
+		double norm = 1 - pow(cutoffcos, ray_angle + 1);
+
+		int x0 = (family == 0 ? 0 : line);
+		int y0 = (family == 0 ? line : 0);
+
+		int n = 2*FIELD;
+		vector<int> hull(n), h(n);
+
+		for(int pass = 0; pass < 2; pass++){
+			int top = 0;
+			for(int k = 0; k < n; k++){
+				int i = (pass == 0 ? k : n - 1 - k) % FIELD;
+				int x = (x0 + dx[family]*i + FIELD) % FIELD;
+				int y = (y0 + dy[family]*i) % FIELD;
+				h[k] = grid->heights[y][x];
+
+			//drop the hull points that fall under the line to this column
+				while(top >= 2 && (int64_t)(hull[top-1] - hull[top-2])*(h[k] - h[hull[top-2]]) >= (int64_t)(h[hull[top-1]] - h[hull[top-2]])*(k - hull[top-2]))
+					top--;
+
+				if(k >= FIELD){
+					double frac = 1;
+					if(top > 0 && h[hull[top-1]] > h[k]){
+						double slope = (h[hull[top-1]] - h[k]) / ((k - hull[top-1]) * step);
+						double sine = slope / sqrt(1 + slope*slope);
+						if(sine > cutoffcos) //rays closer to horizontal than the horizon are blocked
+							frac = (1 - pow(sine, ray_angle + 1)) / norm;
 					}
+					visible[y][x] += frac / 8;
 				}
 
-				//save this point
-				grid->set_point(x, y, z, t, best, min_dist.face);
-				INCR(grains[best].growth);
-				INCR(grains[best].size);
-				INCR(grains[best].faces[min_dist.face].growth);
-				growth++;
+				hull[top++] = k;
 			}
 		}
+	}
+
+	//credit the flux reaching each column in this row to the faces next to the threat on top of it,
+	//split evenly the way addflux would on average
+	int64_t horizon_flux(int y){
+		int64_t total = 0;
+		for(int x = 0; x < FIELD; x++){
+			int z = grid->heights[y][x];
+			int amnt = visible[y][x] * HORIZON_UNIT;
+
+			if(opts.fluxdump)
+				grid->flux[y][x] = visible[y][x] * 255;
+
+		//the flux lands on the threat above the column, or on the substrate if nothing has grown here yet
+			uint16_t grain = grid->get_grain(x, y, z);
+			if(grain != 0 && grain < MAXGRAIN)
+				z++;
+
+			Threat threats[27];
+			Threat * threats_end = threats;
+
+			if(grid->get_grain(x, y, z) == THREAT){
+				threats_end = grid->check_face_threats(threats, x, y, z);
+			}else if(substrate_diffusion && z == 0){ //bare substrate, diffuse like the rays would
+				Coord3i c = substrate_random_walk(x, y);
+				threats_end = grid->check_face_threats(threats, c.x, c.y, c.z);
+			}
+
+			if(threats == threats_end)
+				continue;
 
-		return growth;
+			int each = amnt / (threats_end - threats);
+			for(Threat * th = threats; th != threats_end; th++)
+				ADD(grains[th->grain].faces[th->face].flux, each);
+			total += each * (threats_end - threats);
+		}
+		return total;
 	}
 
-	void addflux(int num){
+	//shoot rays start to start+num of this step from above rows y1 to y2, return how many landed on a threat
+	int64_t addflux(int start, int num, int y1, int y2){
 		double costheta, sintheta, phi;
+		int64_t landed = 0;
 		
 		double cutoffcos = cos(ray_cutoff * M_PI/180); //cutoff angle of 85 degrees
 		double raypow = 1.0/(1.0 + ray_angle);
+		double cutoffpow = pow(cutoffcos, 1.0 + ray_angle);
+
+		for(int i = start; i < start + num; i++){
+			double u[4];
+			for(int d = 0; d < 4; d++){
+				if(sobol){
+					u[d] = sobolseq.get(d, i) + sobolshift[d];
+					if(u[d] >= 1)
+						u[d] -= 1;
+				}else{
+					u[d] = unitrand();
+				}
+			}
 
-		for(int i = 0; i < num; i++){
 			Ray ray;
-			ray.loc.x = unitrand() * FIELD;
-			ray.loc.y = unitrand() * FIELD;
+			ray.loc.x = u[0] * FIELD;
+			ray.loc.y = y1 + u[1] * (y2 - y1);
 			ray.loc.z = grid->zmax-1;
 
-			do{
-				costheta = pow(unitrand(), raypow);
-			}while(costheta < cutoffcos);
+		//invert the cdf of costheta, cos^(1+ray_angle) is uniform over [cutoffcos^(1+ray_angle), 1]
+			costheta = pow(cutoffpow + u[2]*(1 - cutoffpow), raypow);
 			sintheta = sqrt(1 - costheta*costheta);
-			phi = unitrand()*2*M_PI;
+			phi = u[3]*2*M_PI;
 
 			ray.dir.x = cos(phi)*sintheta;
 			ray.dir.y = sin(phi)*sintheta;
 			ray.dir.z = -costheta;
 
-			Coord3i c = raytrace(ray); //trace the ray until it hits a threat or the substrate
-			
-			int grain = grid->get_grain(c.x, c.y, c.z);
+			landed += shoot(ray, false);
+		}
+		return landed;
+	}
+
+	//follow a ray, or with walk a substrate walk, to where it lands and add its flux there, returns whether it landed.
+	//With slabs, a ray or walk that leaves this slab is handed over to the slab it entered to carry on
+	int shoot(Ray ray, bool walk){
+		Coord3i c;
+		int grain = 0;
+
+		if(walk){
+			c = Coord3i(ray.loc);
+		}else{
+			if(!slabs){
+				c = raytrace(ray); //trace the ray until it hits a threat or the substrate
+			}else if(raytrace_slab(ray)){
+				c = Coord3i(ray.loc);
+			}else{
+				hand_over(ray, false);
+				return 0;
+			}
+
+			grain = grid->get_grain(c.x, c.y, c.z);
 
 			if(opts.fluxdump)
 				grid->incrflux(c.x, c.y);
-			
-			if(grain == THREAT){
-				if(diffusion_probability > 0)
-					c = face_random_walk(c.x, c.y, c.z); //walk along the threats for random length
-			}else if(substrate_diffusion && grain == 0 && c.z == 0){ // hit the substrate
+		}
+
+		if(grain == THREAT){
+			if(diffusion_probability > 0){ //walk along the threats for random length
+				if(facewalk)
+					c = face_walk(c.x, c.y, c.z);
+				else
+					c = face_random_walk(c.x, c.y, c.z);
+			}
+		}else if(substrate_diffusion && grain == 0 && c.z == 0){ // hit the substrate
+			if(!slabs){
 				c = substrate_random_walk(c.x, c.y); //walk till it hits a threat
-			}else{
-				i--; //shoot another ray
-				continue; //hit nothing, likely down a deep crevase to points that were already dropped
+			}else if(!substrate_walk_slab(c)){
+				hand_over(Ray(Coord3f(c), Coord3f(0, 0, 0)), true);
+				return 0;
 			}
-			
-			//add to only one of the grains+faces, choosing which randomly
-			Threat threats[27];
-			Threat * threats_end = grid->check_face_threats(threats, c.x, c.y, c.z);
-			Threat * i = threats + (rand() % (threats_end - threats));
-			INCR(grains[i->grain].faces[i->face].flux);
+		}else{
+			return 0; //hit nothing, likely down a deep crevase to points that were already dropped
 		}
+		
+		//add to only one of the grains+faces, choosing which randomly
+		Threat threats[27];
+		Threat * threats_end = grid->check_face_threats(threats, c.x, c.y, c.z);
+		Threat * th = threats + (rand() % (threats_end - threats));
+		INCR(grains[th->grain].faces[th->face].flux);
+		return 1;
+	}
+
+	void hand_over(const Ray & ray, bool walk){
+		Handoff h;
+		h.ray = ray;
+		h.walk = walk;
+
+		int x = (int)ray.loc.x, y = (int)ray.loc.y;
+		grid->fix_period(x, y);
+
+		pthread_mutex_lock(&handoff_lock);
+		handoff[slabs->owner(y)].push_back(h);
+		pthread_mutex_unlock(&handoff_lock);
+	}
+
+	//carry on with the rays and walks that crossed into other slabs until none are left anywhere, returns how many
+	//landed in this one
+	int64_t handoff_rays(){
+		int64_t landed = 0;
+		vector<Handoff> in;
+
+		while(true){
+			int64_t moving = 0;
+			for(int r = 0; r < slabs->num; r++)
+				moving += handoff[r].size();
+			if(slabs->sum(moving) == 0)
+				break;
+
+			slabs->exchange(&handoff[0], in);
+
+			for(int start = 0; start < (int)in.size(); start += 1000)
+				worker->add(new HandoffReq(this, &in, start, min((int)in.size() - start, 1000)));
+			landed += worker->wait();
+		}
+		return landed;
+	}
+
+	//trace a ray within this slab from a point not checked yet, false if it left the slab first, stopped at the first
+	//point outside it
+	bool raytrace_slab(Ray & ray){
+		while(grid->owns((int)ray.loc.x, (int)ray.loc.y)){
+			if(grid->get_grain(ray.loc) == THREAT || !ray.incr(grid->zmin))
+				return true;
+		}
+		return false;
+	}
+
+	//substrate_random_walk within this slab from a point not checked yet, false if it left the slab first
+	bool substrate_walk_slab(Coord3i & c){
+		while(grid->get_grain(c.x, c.y, 0) != THREAT){
+			switch(rand() % 4){
+				case 0: c.x++; break;
+				case 1: c.x--; break;
+				case 2: c.y++; break;
+				case 3: c.y--; break;
+			}
+			if(!grid->owns(c.x, c.y))
+				return false;
+		}
+		return true;
 	}
 
 	Coord3i raytrace(Ray ray){
-		while(ray.incr(grid->zmin) && grid->get_grain(ray.loc) != THREAT); //empty body
+		if(!jumprays){
+			while(ray.incr(grid->zmin) && grid->get_grain(ray.loc) != THREAT); //empty body
+
+			return Coord3i(ray.loc);
+		}
+
+		do{
+		//a step moves one unit, but can round to a point up to sqrt(3) further away, so any steps that stay 2 inside
+		//the distance to the nearest threat can't land on one, and can be jumped over
+			int skip = grid->threat_dist((int)ray.loc.x, (int)ray.loc.y, (int)ray.loc.z) - 2;
+			if(skip > 0 && ray.loc.z + ray.dir.z*skip >= grid->zmin)
+				ray.loc += ray.dir * skip;
+		}while(ray.incr(grid->zmin) && grid->get_grain(ray.loc) != THREAT);
 
 		return Coord3i(ray.loc);
 	}
 
+	//distance transform of the threats on the substrate, so substrate walks can jump across the open areas.
+	//Exact euclidean distances, one pass down the columns and one along the rows
+	void substrate_distances(){
+		if(!substrate)
+			substrate = new float[FIELD][FIELD];
+
+		for(int pass = 0; pass < 2; pass++){
+			for(int line = 0; line < FIELD; line++)
+				worker->add(new SubstrateDistReq(this, pass, line));
+			worker->wait();
+		}
+	}
+
+	//pass 0 finds the squared distance to the nearest threat in column x=line, pass 1 combines those along row y=line.
+	//Each is the lower envelope of parabolas of Felzenszwalb and Huttenlocher, with the line repeated either side
+	//so the distances wrap around the periodic field
+	void substrate_dist_line(int pass, int line){
+		const float inf = 1e20;
+		float f[FIELD];
+		for(int i = 0; i < FIELD; i++){
+			if(pass == 0)
+				f[i] = (grid->get_grain(line, i, 0) == THREAT ? 0 : inf);
+			else
+				f[i] = substrate[line][i];
+		}
+
+		int n = 3*FIELD;
+		vector<int> v(n);
+		vector<float> zb(n + 1);
+		int k = -1;
+
+		for(int q = 0; q < n; q++){
+			float fq = f[q % FIELD];
+			if(fq >= inf)
+				continue;
+
+			int p = q - FIELD; //sites run from -FIELD to 2*FIELD-1
+			float s = 0;
+			while(k >= 0){
+				int r = v[k];
+				float fr = f[(r + FIELD) % FIELD];
+				s = ((fq + (float)p*p) - (fr + (float)r*r)) / (2.0f*(p - r));
+				if(s > zb[k])
+					break;
+				k--;
+			}
+			k++;
+			v[k] = p;
+			zb[k] = (k == 0 ? -inf : s);
+			zb[k+1] = inf;
+		}
+
+		for(int q = 0, j = 0; q < FIELD; q++){
+			float d = inf;
+			if(k >= 0){
+				while(zb[j+1] < q)
+					j++;
+				d = (float)(q - v[j])*(q - v[j]) + f[(v[j] + FIELD) % FIELD];
+			}
+			if(pass == 0)
+				substrate[q][line] = d;
+			else
+				substrate[line][q] = (d >= inf ? inf : sqrt(d));
+		}
+	}
+
 	Coord3i substrate_random_walk(int x, int y){
 		do{
+		//walk on spheres: a walk from the centre of a circle with no threats in it leaves it at a uniformly random
+		//point on the edge, so jump straight there. Near a threat the walk goes one step at a time
+			if(substrate_jumps){
+				grid->fix_period(x, y);
+				float d = substrate[y][x];
+				if(d >= 4 && d < FIELD*FIELD){
+					double r = d - 2;
+					double phi = unitrand()*2*M_PI;
+					x += (int)floor(r*cos(phi) + 0.5);
+					y += (int)floor(r*sin(phi) + 0.5);
+					continue;
+				}
+			}
+
 			switch(rand() % 4){
 				case 0: x++; break;
 				case 1: x--; break;
@@ -448,9 +1147,14 @@ public:
 
 	Coord3i face_random_walk(int x, int y, int z){
 		Point * p = grid->get_point(x, y, z);
+		int fails = 0;
 
 		while((rand() % 256) < p->diffprob){
+			fails = 0;
 retry: //used to retry on when the random choice below is invalid, without re-checking the probability
+			if(++fails > 64) //no threat next to this one, nowhere to go
+				break;
+
 			int dir = rand() % 6;
 			switch(dir){
 				case 0: x++; break;
@@ -481,44 +1185,98 @@ retry: //used to retry on when the random choice below is invalid, without re-ch
 		return Coord3i(x, y, z);
 	}
 
-/*
-//face walk that tries to be faster and more fair than the random walk
+	//face walk that ends up where face_random_walk would, without taking every step. The number of steps is
+	//geometric in the diffusion probability, and the net distance of that many unit steps over a surface is
+	//rayleigh distributed, so travel that far in a random direction along the face plane instead. When the
+	//walk crosses onto a different face the direction is projected onto the new face's plane.
 	Coord3i face_walk(int x, int y, int z){
-		//choose length to travel
-		double length = 1.0; //fix to be the correct random distribution later
+		Coord3i last(x, y, z);
+		double q = grid->get_point(x, y, z)->diffprob / 256.0;
 
-		//choose direction to travel
-		Ray ray;
-		ray.x = x;
-		ray.y = y;
-		ray.z = z;
-		
+		if(q <= 0)
+			return last;
+
+		double steps = floor(log((rand() + 1.0) / (RAND_MAX + 1.0)) / log(q));
+		if(steps < 1)
+			return last;
+
+		double length = sqrt(-steps * log((rand() + 1.0) / (RAND_MAX + 1.0)));
+
+	//start on the face of one of the neighbouring points, as addflux picks them
+		Threat threats[27];
+		Threat * threats_end = grid->check_face_threats(threats, x, y, z);
+		if(threats == threats_end)
+			return last;
+		Threat on = threats[rand() % (threats_end - threats)];
+
+		Coord3f normal = grains[on.grain].faces[on.face].vec;
+		normal.scale();
+
+	//a random direction in the plane of the face
 		double theta = unitrand()*2*M_PI;
 		double k = unitrand()*2.0 - 1;
-		
-		double i = sqrt(1 - k*k)*cos(theta);
-		double j = sqrt(1 - k*k)*sin(theta);
-		
-		ray.(a,b,c) = face.(a,b,c) x (i,j,k);
-		ray.(a,b,c) = ray.(a,b,c) / (length of ray.(a,b,c))
+		Coord3f dir = normal.cross(Coord3f(sqrt(1 - k*k)*cos(theta), sqrt(1 - k*k)*sin(theta), k));
+		if(dir.len() < 0.01)
+			return last;
+		dir.scale();
+
+		Coord3f loc(x + 0.5, y + 0.5, z + 0.5);
 
 		while(length > 0){
-			if(!ray.incr(grid->zmin))
+			double step = min(1.0, length);
+			loc += dir * step;
+			length -= step;
+
+			Coord3i c((int)floor(loc.x), (int)floor(loc.y), (int)floor(loc.z));
+
+		//the threats are a layer over the face, so step on or off the plane to stay on them
+			Coord3i off = axis(normal);
+			int shift;
+			for(shift = 0; shift < 3; shift++){
+				Coord3i t = c;
+				if(shift == 1) { t.x += off.x; t.y += off.y; t.z += off.z; }
+				if(shift == 2) { t.x -= off.x; t.y -= off.y; t.z -= off.z; }
+
+				if(t.z >= grid->zmin && t.z < grid->zmax && grid->get_grain(t.x, t.y, t.z) == THREAT){
+					loc += Coord3f(t.x - c.x, t.y - c.y, t.z - c.z);
+					c = t;
+					break;
+				}
+			}
+			if(shift == 3) //walked off the surface, stop at the last threat
 				break;
-				
-			Point * p = grid->get_point(x, y, z);
 
-			//move one unit in the direction
-			//substract face diffusion length factor from length
-			//if no longer on this face
-				//figure out which face it is moving to
-				//find the spine
-				//set the new direction
+			last = c;
+
+		//the point under this threat decides which face the walk is on
+			Coord3i u(c.x - off.x, c.y - off.y, c.z - off.z);
+			if(u.z < grid->zmin)
+				continue;
+			Point * p = grid->get_point(u.x, u.y, u.z);
+			if(p->grain == 0 || p->grain >= MAXGRAIN || (p->grain == on.grain && p->face == on.face))
+				continue;
+
+			on.grain = p->grain;
+			on.face = p->face;
+			normal = grains[on.grain].faces[on.face].vec;
+			normal.scale();
+
+			dir -= normal * dir.dot(normal);
+			if(dir.len() < 0.01) //ran straight into the new face
+				break;
+			dir.scale();
 		}
 
-		return Coord3i(x, y, z);
+		return last;
+	}
+
+	//the unit step along the axis closest to v
+	static Coord3i axis(const Coord3f & v){
+		double ax = fabs(v.x), ay = fabs(v.y), az = fabs(v.z);
+		if(ax >= ay && ax >= az) return Coord3i(v.x > 0 ? 1 : -1, 0, 0);
+		if(ay >= az)             return Coord3i(0, v.y > 0 ? 1 : -1, 0);
+		return Coord3i(0, 0, v.z > 0 ? 1 : -1);
 	}
-*/
 };
 
 
@@ -0,0 +1,167 @@
+
+#ifndef _LAYERGRAINS_H_
+#define _LAYERGRAINS_H_
+
+#include "plugins.h"
+
+//Grain sizes and grain boundaries of each layer as it's finished, in one pass over the plane split into bands of
+//rows. The perimeter of a grain is the number of point edges it shares with other grains or empty space, periodic
+//on both axes. Boundaries are counted by the faces on either side, empty space as face -1. Writes the area and
+//perimeter of every grain in the layer to layergrains.%05d.csv, a line of sizes and a histogram of areas in powers
+//of 2 to grainsizes.csv, and the boundary counts to boundaries.csv
+class LayerGrains : public Plugin {
+	static const int num_bands = 16;
+
+	//what one band counted, kept between layers so nothing is allocated per layer
+	struct Band {
+		vector<int> area, perimeter; //per grain
+		vector<int> pairs; //boundaries by the faces on either side, (num_faces+1)^2 with empty as num_faces
+	};
+
+	struct BandReq : WorkRequest {
+		LayerGrains * l;
+		const Plane * plane;
+		int b;
+		BandReq(LayerGrains * L, const Plane * P, int B) : l(L), plane(P), b(B) { }
+		int64_t run(){
+			l->count(plane, b);
+			return 0;
+		}
+	};
+
+	Band bands[num_bands];
+	int num_faces;
+	int num_bins; //areas 1, 2-3, 4-7, ... up to FIELD*FIELD
+
+	//grain and face of a point, anything not taken by a grain is empty
+	static void lookup(const Plane * plane, int x, int y, int & grain, int & face){
+		const Point * p = plane->get(x, y);
+		if(p->grain && p->grain < MAXGRAIN){
+			grain = p->grain;
+			face = p->face;
+		}else{
+			grain = 0;
+			face = -1;
+		}
+	}
+
+	void edge(Band & band, int g1, int f1, int g2, int f2){
+		if(g1 == g2)
+			return;
+		band.perimeter[g1]++;
+		band.perimeter[g2]++;
+		int a = (f1 < 0 ? num_faces : f1);
+		int b = (f2 < 0 ? num_faces : f2);
+		band.pairs[min(a, b)*(num_faces + 1) + max(a, b)]++;
+	}
+
+	//each point and its edges to the right and below
+	void count(const Plane * plane, int b){
+		Band & band = bands[b];
+		int y1 = FIELD * b / num_bands, y2 = FIELD * (b + 1) / num_bands;
+		for(int y = y1; y < y2; y++){
+			for(int x = 0; x < FIELD; x++){
+				int g, f, g2, f2;
+				lookup(plane, x, y, g, f);
+				band.area[g]++;
+				lookup(plane, (x + 1) % FIELD, y, g2, f2);
+				edge(band, g, f, g2, f2);
+				lookup(plane, x, (y + 1) % FIELD, g2, f2);
+				edge(band, g, f, g2, f2);
+			}
+		}
+	}
+
+public:
+	LayerGrains(){
+		num_faces = 0;
+		num_bins = 1;
+		while((1 << num_bins) <= FIELD*FIELD)
+			num_bins++;
+
+		FILE * fd = fopen("grainsizes.csv", "w");
+		fprintf(fd, "layer,num grains,mean area,mean perimeter,grain boundaries,empty boundaries");
+		for(int i = 0; i < num_bins; i++)
+			fprintf(fd, ",area %d+", 1 << i);
+		fprintf(fd, "\n");
+		fclose(fd);
+
+		fd = fopen("boundaries.csv", "w");
+		fprintf(fd, "layer,face1,face2,count\n");
+		fclose(fd);
+	}
+
+	void layer(Worker * worker, int z, const Plane * plane, const vector<Grain> & grains){
+		for(unsigned int i = 1; i < grains.size(); i++)
+			num_faces = max(num_faces, (int)grains[i].faces.size());
+
+		for(int b = 0; b < num_bands; b++){
+			bands[b].area.assign(grains.size(), 0);
+			bands[b].perimeter.assign(grains.size(), 0);
+			bands[b].pairs.assign((num_faces + 1)*(num_faces + 1), 0);
+			worker->add(new BandReq(this, plane, b));
+		}
+		worker->wait();
+
+		Band & sum = bands[0];
+		for(int b = 1; b < num_bands; b++){
+			for(unsigned int i = 0; i < grains.size(); i++){
+				sum.area[i] += bands[b].area[i];
+				sum.perimeter[i] += bands[b].perimeter[i];
+			}
+			for(unsigned int i = 0; i < sum.pairs.size(); i++)
+				sum.pairs[i] += bands[b].pairs[i];
+		}
+
+		char filename[50];
+		sprintf(filename, "layergrains.%05d.csv", z);
+		FILE * fd = fopen(filename, "w");
+		fprintf(fd, "grain,area,perimeter\n");
+
+		int num = 0;
+		int64_t area = 0, perimeter = 0;
+		vector<int> hist(num_bins, 0);
+		for(unsigned int i = 1; i < grains.size(); i++){
+			if(!sum.area[i])
+				continue;
+			fprintf(fd, "%d,%d,%d\n", i, sum.area[i], sum.perimeter[i]);
+			num++;
+			area += sum.area[i];
+			perimeter += sum.perimeter[i];
+			int bin = 0;
+			while((2 << bin) <= sum.area[i])
+				bin++;
+			hist[bin]++;
+		}
+		fclose(fd);
+
+		int64_t empty = 0, between = 0;
+		for(int a = 0; a <= num_faces; a++){
+			for(int b = a; b <= num_faces; b++){
+				int n = sum.pairs[a*(num_faces + 1) + b];
+				if(b == num_faces)
+					empty += n;
+				else
+					between += n;
+			}
+		}
+
+		fd = fopen("grainsizes.csv", "a");
+		fprintf(fd, "%d,%d,%f,%f,%lld,%lld", z, num, (num ? (double)area/num : 0.0), (num ? (double)perimeter/num : 0.0),
+			(long long)between, (long long)empty);
+		for(int i = 0; i < num_bins; i++)
+			fprintf(fd, ",%d", hist[i]);
+		fprintf(fd, "\n");
+		fclose(fd);
+
+		fd = fopen("boundaries.csv", "a");
+		for(int a = 0; a <= num_faces; a++)
+			for(int b = a; b <= num_faces; b++)
+				if(sum.pairs[a*(num_faces + 1) + b])
+					fprintf(fd, "%d,%d,%d,%d\n", z, a, (b == num_faces ? -1 : b), sum.pairs[a*(num_faces + 1) + b]);
+		fclose(fd);
+	}
+};
+
+#endif
+
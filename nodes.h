@@ -0,0 +1,105 @@
+
+#ifndef _NODES_H_
+#define _NODES_H_
+
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+//memory policies from linux/mempolicy.h, called through syscall so there's no need for libnuma
+#define NODES_MPOL_INTERLEAVE 3
+#define NODES_MPOL_MF_MOVE    (1<<1)
+
+//The NUMA nodes of the machine, read from sysfs, for pinning threads to the cores of a node and placing memory.
+//Without NUMA it finds one node holding every core, and everything it does is harmless.
+class Nodes {
+	//parse a sysfs list like "0-3,8-11" into its numbers
+	static void parse_list(const char * str, vector<int> & list){
+		while(*str && *str != '\n'){
+			char * end;
+			int a = strtol(str, &end, 10);
+			int b = a;
+			if(end == str)
+				break;
+			if(*end == '-')
+				b = strtol(end + 1, &end, 10);
+			for(int i = a; i <= b; i++)
+				list.push_back(i);
+			str = (*end == ',' ? end + 1 : end);
+		}
+	}
+
+	static bool read_list(const char * filename, vector<int> & list){
+		FILE * fd = fopen(filename, "r");
+		if(!fd)
+			return false;
+		char buf[4096];
+		if(fgets(buf, sizeof(buf), fd))
+			parse_list(buf, list);
+		fclose(fd);
+		return true;
+	}
+
+public:
+	vector<int> ids;            //kernel node number of each node
+	vector< vector<int> > cpus; //cores of each node
+
+	Nodes(){
+		vector<int> online;
+		if(read_list("/sys/devices/system/node/online", online)){
+			for(unsigned int i = 0; i < online.size(); i++){
+				char filename[100];
+				sprintf(filename, "/sys/devices/system/node/node%d/cpulist", online[i]);
+				vector<int> c;
+				read_list(filename, c);
+				if(c.empty()) //memory only, nothing to run there
+					continue;
+				ids.push_back(online[i]);
+				cpus.push_back(c);
+			}
+		}
+
+		if(ids.empty()){ //no sysfs, one node and no pinning
+			ids.push_back(0);
+			cpus.push_back(vector<int>());
+		}
+	}
+
+	int num() const {
+		return ids.size();
+	}
+
+	//pin the calling thread to the cores of node n
+	void pin(int n) const {
+		if(cpus[n].empty())
+			return;
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for(unsigned int i = 0; i < cpus[n].size(); i++)
+			CPU_SET(cpus[n][i], &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+
+	//spread the pages of len bytes at ptr evenly over all the nodes, moving any already touched.
+	//Only whole pages are covered, the partial ones at either end are left where they are
+	bool interleave(void * ptr, size_t len) const {
+		if(num() < 2)
+			return true;
+
+		uintptr_t page = sysconf(_SC_PAGESIZE);
+		uintptr_t begin = ((uintptr_t)ptr + page - 1) / page * page;
+		uintptr_t end = ((uintptr_t)ptr + len) / page * page;
+		if(begin >= end)
+			return true;
+
+		int bits = 8*sizeof(unsigned long);
+		vector<unsigned long> mask(*max_element(ids.begin(), ids.end()) / bits + 1, 0);
+		for(int n = 0; n < num(); n++)
+			mask[ids[n] / bits] |= 1UL << (ids[n] % bits);
+
+		return (syscall(SYS_mbind, begin, end - begin, NODES_MPOL_INTERLEAVE, &mask[0], mask.size()*bits + 1, NODES_MPOL_MF_MOVE) == 0);
+	}
+};
+
+#endif
+
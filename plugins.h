@@ -0,0 +1,26 @@
+
+#ifndef _PLUGINS_H_
+#define _PLUGINS_H_
+
+#include "worker.h"
+
+class Grid;
+struct Plane;
+class Grain;
+
+//An in situ analysis, run on the live simulation so its results don't have to be worked out from a datadump after.
+//step is called after every timestep once the surface is settled, layer as each layer is finished, just before it's
+//dropped, and finish once after the last layer. Everything is read only, the worker is idle so a plugin can spread
+//its own work over the threads, and it writes its own files to the current directory. Plugins don't run with slabs,
+//since no slab holds whole planes
+class Plugin {
+public:
+	virtual ~Plugin(){ }
+
+	virtual void step(Worker * worker, int t, const Grid * grid, const vector<Grain> & grains){ }
+	virtual void layer(Worker * worker, int z, const Plane * plane, const vector<Grain> & grains){ }
+	virtual void finish(Worker * worker){ }
+};
+
+#endif
+
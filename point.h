@@ -0,0 +1,37 @@
+
+#ifndef _POINT_H_
+#define _POINT_H_
+
+#include <stdint.h>
+
+#define FULLPOINT (0xFFFF) //internal value to mean this point was dropped to disk
+#define THREAT    (0xFFFE) //this point is threatened by other points, but is empty
+#define POCKET    (0xFFFD) //this point is empty space, but can never be taken since it is in a pocket
+#define TPOCKET   (0xFFFC) //also in a pocket, but at the edge of the pocket and threatened
+#define MARK      (0xFFFB) //marks a threat for the mark/sweep pocket search
+#define MAXGRAIN  (0xFFF0) //max amount of grains, anything above is reserved for special values
+#define MAXSTEPS  (65000)  //point times are 16 bits, with FULLPOINT reserved
+
+struct Point {
+	uint16_t time;  // time it was taken
+	uint16_t grain; // grain that took it
+	uint8_t  face;  // face on that grain
+	uint8_t  diffprob; //probability of diffusion from the point. Only makes sense if this point is a threat
+
+	Point(){
+		time = 0;
+		grain = 0;
+		face = 0;
+		diffprob = 0;
+	}
+	
+	Point(uint16_t t, uint16_t g, uint8_t f, uint8_t d){
+		time = t;
+		grain = g;
+		face = f;
+		diffprob = d;
+	}
+};
+
+#endif
+
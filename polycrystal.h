@@ -0,0 +1,360 @@
+
+#ifndef _POLYCRYSTAL_H_
+#define _POLYCRYSTAL_H_
+
+//libpolycrystal: the whole simulator as a header only library. Include this in one translation unit, set opts and a
+//Config and drive a Simulation. crystal is a command line on top of it
+
+#include <vector>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <stdint.h>
+#include <cmath>
+#include <time.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <cstdarg>
+#include "gd.h"
+#include <pthread.h>
+#include <queue>
+#include <set>
+#include <algorithm>
+#include <string>
+#include <stdexcept>
+
+using namespace std;
+
+//some compile time options
+#ifndef FIELD
+#define FIELD (1<<10) //1024, size of the grid
+#endif
+
+#ifndef MAX_THREADS
+#define MAX_THREADS 100 //slight speed improvement by setting to 1
+#endif
+
+//#define TILED //store sectors as morton ordered tiles instead of rows, better cache locality for the stencils
+
+//Output options, shared by everything in the process. All off until set, crystal turns on its defaults
+struct Options {
+	bool cmdline;   // output the command line that was used
+	bool console;   // output the console output to a file too
+	bool timestats; // output time stats
+	bool layerstats;// output layer stats
+	bool slopemap;  // map of slopes, easiest visualization
+	bool isomorphic;// isomorphic visualization by tracing the voxels
+	bool surf3d;    // isomorphic visualization of the height field, doesn't need the whole volume
+	bool perspective;// surf3d with perspective instead of isometric
+	bool heightmap; // map of heights
+	bool heightdump;// dump of heights, may be possible to turn into a 3d model
+	bool timemap;   // map of grains as a top down view, may be useful for stats?
+	bool fluxdump;  // dump of amount of flux received per x,y coord
+	bool peaks;     // dump of the active peaks per timestep: id,x,y,z
+	bool tracks;    // how each peak moved since the last timestep
+	bool psd;       // power spectrum and height-height correlation of the surface per timestep
+	bool texture;   // orientations of the surface grains per timestep
+	bool events;    // log of grains buried and emerging again
+	bool layermap;  // map of grains of a layer, may be useful for stats?
+	bool grainstats;// grain sizes and boundaries of each layer
+	bool voronei;   // voronei diagram of initial grain placements
+	bool graininit; // output the initial grain placements
+	bool growth;    // dump of growth of each grain/face
+	bool datadump;  // full grid data dump, could be read after the fact to generate any stats needed
+	bool savemem;   // dump the data grid temporarily to save memory
+	bool pockets;   // mark pockets as they close off, potentially save more memory and get better data dumps
+	bool interrupt; // set by the interrupt handler, meaning finish your current iteration then exit
+	bool randcolor; // use random colours instead of directional colours
+	bool batch;     // batch runs going side by side, so the console output only goes to each one's console.txt
+} opts;
+
+inline void echo(const char *format, ...){
+	char buffer[1024];
+
+	va_list args;
+	va_start(args, format);
+	vsnprintf(buffer, sizeof(buffer)-1, format, args);
+	va_end(args);
+
+	if(!opts.batch)
+		printf("%s", buffer);
+	
+	if(opts.console){
+		FILE *fd = fopen("console.txt", "a");
+		fprintf(fd, "%s", buffer);
+		fclose(fd);
+	}
+}
+
+#include "shapes.h"
+#include "grain.cpp"
+#include "grid.cpp"
+#include "growth.cpp"
+#include "psd.h"
+#include "layergrains.h"
+#include "texture.h"
+#include "tracks.h"
+//everything a run takes, besides the output options. crystal reads it from the command line, dir, batch, jobs,
+//num_slabs and numa are only used there
+struct Config {
+	char * dir;
+	int    max_memory;
+	int    threads;
+	int    num_slabs;
+	bool   numa;
+	char * batch; //file of runs to make, one per line
+	int    jobs;  //batch runs at once
+
+	bool   load_data;
+	int    num_steps;
+	double growth_factor;
+	double adaptive;
+	double start_angle;
+	int    num_grains;
+	int    end_grains;
+	double min_dist;
+	double ray_angle;
+	double ray_cutoff;
+	int    ray_step;
+	double ray_ratio;
+	double diffusion;
+	bool   substrate_diffusion;
+	bool   horizon;
+	bool   sobol;
+	bool   jumprays;
+	bool   facewalk;
+	int    shape_id;
+
+	Config(){
+		dir        = NULL;
+		max_memory = 0;
+		threads    = min(5, MAX_THREADS);
+		num_slabs  = 1;
+		numa       = false;
+		batch      = NULL;
+		jobs       = 1;
+
+		load_data  = false;
+		num_steps  = 200;
+		growth_factor = 1.0;
+		adaptive   = 0;
+		start_angle = 0.0;
+		num_grains = 10000;
+		end_grains = 20;
+		min_dist   = 0.0;
+		ray_angle  = 0;
+		ray_cutoff = 85;
+		ray_step   = 10;
+		ray_ratio  = 1.0;
+		diffusion  = 0;
+		substrate_diffusion = true;
+		horizon    = false;
+		sobol      = false;
+		jumprays   = false;
+		facewalk   = false;
+		shape_id   = 6;
+	}
+};
+const Shape * find_shape(int id){
+	switch(id){
+		case 4:  return &Tetrahedron;
+		case 5:  return &Stretched_cube;
+		case 6:  return &Cube;
+		case 7:  return &Twin_tetrahedron;
+		case 8:  return &Octahedron;
+		case 9:  return &Stretched_hex;
+		case 12: return &Dodecahedron;
+		case 13: return &Rhombic_dodecahedron;
+		case 14: return &Cuboctahedron;
+		case 20: return &Icosahedron;
+		case 26: return &Rhombic_Cuboctahedron;
+		case 252:return &Sphere252;
+		default: return NULL;
+	}
+}
+
+//A whole simulation, for driving the growth from other code. Set it up from a Config, init, then step until it
+//returns false, reading the state in between. Any output files turned on in opts go to the current directory.
+//The accessors point straight into the live simulation, so they're only valid until the next step
+class Simulation {
+	Config config;
+	Growth * growth;
+	Slabs * slabs;
+	int t;
+	bool stopped; //the last step ended the run
+	bool initialized; //init has placed the grains
+	vector<Plugin *> plugins;
+
+	//not copyable, it owns growth and the plugins
+	Simulation(const Simulation &);
+	Simulation & operator=(const Simulation &);
+
+public:
+	//throws invalid_argument for a config it can't run, the command line and python check theirs first. The
+	//others throw logic_error when called out of order: init once, then step, run or finish
+	Simulation(const Config & c, Slabs * s = NULL, const Nodes * nodes = NULL) : config(c) {
+		if(!find_shape(config.shape_id))
+			throw invalid_argument("Unknown shape");
+		if(s && (opts.psd || opts.grainstats || opts.texture || opts.tracks))
+			throw invalid_argument("Plugins don't work with slabs");
+		if(opts.psd && (FIELD & (FIELD - 1)))
+			throw invalid_argument("The power spectrum needs FIELD to be a power of 2");
+		if(config.min_dist == 0.0)
+			config.min_dist = sqrt(FIELD*FIELD/(M_PI*config.num_grains));
+
+		growth = new Growth(config.threads, nodes);
+
+		growth->num_steps = config.num_steps;
+		growth->end_grains = config.end_grains;
+		growth->growth_factor = config.growth_factor;
+		growth->adaptive = config.adaptive;
+
+		growth->max_memory = config.max_memory;
+
+		growth->start_angle = config.start_angle;
+		growth->ray_angle   = config.ray_angle;
+		growth->ray_cutoff  = config.ray_cutoff;
+		growth->ray_step    = config.ray_step;
+		growth->ray_ratio   = config.ray_ratio;
+		growth->horizon     = config.horizon;
+		growth->sobol       = config.sobol;
+		growth->jumprays    = config.jumprays;
+
+		growth->diffusion_probability = config.diffusion;
+		growth->substrate_diffusion = config.substrate_diffusion;
+		growth->facewalk = config.facewalk;
+
+		slabs = s;
+		if(slabs)
+			growth->set_slabs(slabs);
+
+		t = 0;
+		stopped = false;
+		initialized = false;
+
+		//the built in analyses turned on in opts
+		if(opts.psd)
+			add_plugin(new PSD());
+		if(opts.grainstats)
+			add_plugin(new LayerGrains());
+		if(opts.texture)
+			add_plugin(new Texture());
+		if(opts.tracks)
+			add_plugin(new PeakTracks());
+	}
+
+	~Simulation(){
+		delete growth;
+		for(unsigned int i = 0; i < plugins.size(); i++)
+			delete plugins[i];
+	}
+
+	//run an analysis along with the simulation, see Plugin. Add them before init, the simulation deletes them.
+	//Plugins don't work with slabs, so false if there are any, and p is still the caller's
+	bool add_plugin(Plugin * p){
+		if(slabs)
+			return false;
+		plugins.push_back(p);
+		growth->grid->plugins.push_back(p);
+		return true;
+	}
+
+	//grain placements to share between simulations with the same grain options, see init
+	static vector<Grain> place(const Config & c){
+		double min_dist = c.min_dist;
+		if(min_dist == 0.0)
+			min_dist = sqrt(FIELD*FIELD/(M_PI*c.num_grains));
+
+		vector<Grain> placed(1); //grain 0 is special as non-existent
+		Growth::place_grains(placed, c.num_grains, min_dist, c.start_angle, c.load_data);
+		return placed;
+	}
+
+	//place the grains, or take them from placed, and set them on the substrate as the first two timesteps
+	void init(const vector<Grain> * placed = NULL){
+		if(initialized)
+			throw logic_error("Simulation is already initialized");
+		initialized = true;
+
+		growth->init(config.num_grains, config.min_dist, *find_shape(config.shape_id), config.load_data, placed);
+
+		if(slabs) //the grains are the same everywhere, the rays aren't
+			srand(rand() + slabs->rank);
+
+		t = 1;
+	}
+
+	//run the next timestep, returns false once the run is over: out of steps, down to the end grains, out of memory
+	//or interrupted
+	bool step(){
+		if(!initialized)
+			throw logic_error("Simulation needs init before step");
+		if(stopped || growth->interrupted())
+			return false;
+
+		if(t >= (config.adaptive ? MAXSTEPS : config.num_steps)){
+			if(config.adaptive) //the floor on the step size needs more steps than the point times can count
+				echo("Hit the step limit: %d steps without growing as far as %d steps of %.2f\n", MAXSTEPS, config.num_steps, config.growth_factor);
+			stopped = true;
+			return false;
+		}
+
+		t++;
+		stopped = !growth->step(t);
+		return true;
+	}
+
+	//output the layers still held, once the stepping is done
+	void finish(){
+		if(!initialized)
+			throw logic_error("Simulation needs init before finish");
+		growth->finish();
+	}
+
+	//step to the end and finish
+	void run(){
+		int start = time_msec();
+
+		while(step());
+		finish();
+
+		echo("Finished in %d sec\n", (time_msec() - start)/1000);
+	}
+
+	int time() const { return t; }
+	const Config & get_config() const { return config; }
+
+	//the height of the top point in each column, indexed [y][x]
+	const uint16_t (*heights() const)[FIELD] { return growth->grid->heights; }
+
+	//flux landed in each column, only counted with opts.fluxdump
+	const uint8_t (*flux() const)[FIELD] { return growth->grid->flux; }
+
+	//grain 0 is the blank grain, the rest hold their position, rotation, faces and counts from the last step
+	const vector<Grain> & grains() const { return growth->grains; }
+
+	//only layers zmin to zmax are held, the ones below are already finished and output
+	int zmin() const { return growth->grid->zmin; }
+	int zmax() const { return growth->grid->zmax; }
+
+	//the point at x,y,z, NULL outside the layers held. Wraps around on x and y
+	const Point * point(int x, int y, int z) const {
+		if(z < zmin() || z >= zmax())
+			return NULL;
+		return growth->grid->get_point(x, y, z);
+	}
+
+	//the FIELD points of sector s of layer z, in the order Plane::index gives, so a row without TILED. NULL if it isn't
+	//held, either outside zmin to zmax or never touched, or filled and dropped to save memory
+	const Point * sector(int z, int s) const {
+		if(z < zmin() || z >= zmax() || s < 0 || s >= SECTORS_X*SECTORS_Y)
+			return NULL;
+		return growth->grid->planes[z]->grid[s].points;
+	}
+
+	const Grid * grid() const { return growth->grid; }
+};
+
+#endif
+
@@ -0,0 +1,177 @@
+
+#ifndef _PSD_H_
+#define _PSD_H_
+
+#include <complex>
+#include "plugins.h"
+
+//Power spectrum and height-height correlation of the surface every timestep, from a 2D FFT of the periodic height
+//field spread over the threads. The spectrum |H(k)|^2 is averaged over rings of |k| and written with the height-height
+//correlation G(r) = <(h(x+r) - h(x))^2>, which comes from the autocovariance C(r), the inverse transform of the
+//spectrum. Line n of psd.%05d.csv has the spectrum at n cycles across the field and G at a distance of n. The
+//correlation length is where C(r) falls to C(0)/e. FIELD must be a power of 2
+class PSD : public Plugin {
+	typedef complex<double> cplx;
+
+	struct FFTReq : WorkRequest {
+		PSD * p;
+		bool cols, inverse;
+		int a, b; //rows or columns a to b
+		FFTReq(PSD * P, bool C, bool I, int A, int B) : p(P), cols(C), inverse(I), a(A), b(B) { }
+		int64_t run(){
+			if(cols)
+				p->fft_cols(a, b, inverse);
+			else
+				p->fft_rows(a, b, inverse);
+			return 0;
+		}
+	};
+
+	cplx * data; //FIELD*FIELD, indexed y*FIELD+x
+	uint16_t * ring; //FIELD*FIELD, distance of each point from the origin, periodic on both axes
+	vector<int> ring_size;
+	cplx twiddle[FIELD/2]; //e^(-2 pi i k / FIELD)
+
+	//in place radix 2 transform of FIELD values, unscaled either way
+	void fft(cplx * v, bool inverse) const {
+		for(int i = 1, j = 0; i < FIELD; i++){ //bit reversed order
+			int bit = FIELD >> 1;
+			for(; j & bit; bit >>= 1)
+				j ^= bit;
+			j ^= bit;
+			if(i < j)
+				swap(v[i], v[j]);
+		}
+
+		for(int len = 2; len <= FIELD; len <<= 1){
+			int step = FIELD / len;
+			for(int i = 0; i < FIELD; i += len){
+				for(int k = 0; k < len/2; k++){
+					cplx w = (inverse ? conj(twiddle[k*step]) : twiddle[k*step]);
+					cplx u = v[i + k];
+					cplx t = v[i + k + len/2] * w;
+					v[i + k] = u + t;
+					v[i + k + len/2] = u - t;
+				}
+			}
+		}
+	}
+
+	void fft_rows(int y1, int y2, bool inverse){
+		for(int y = y1; y < y2; y++)
+			fft(data + y*FIELD, inverse);
+	}
+
+	//columns are copied out to keep the transform itself in cache
+	void fft_cols(int x1, int x2, bool inverse){
+		vector<cplx> col(FIELD);
+		for(int x = x1; x < x2; x++){
+			for(int y = 0; y < FIELD; y++)
+				col[y] = data[y*FIELD + x];
+			fft(&col[0], inverse);
+			for(int y = 0; y < FIELD; y++)
+				data[y*FIELD + x] = col[y];
+		}
+	}
+
+	void transform(Worker * worker, bool inverse){
+		int chunk = max(1, FIELD/64);
+		for(int y = 0; y < FIELD; y += chunk)
+			worker->add(new FFTReq(this, false, inverse, y, min(y + chunk, FIELD)));
+		worker->wait();
+		for(int x = 0; x < FIELD; x += chunk)
+			worker->add(new FFTReq(this, true, inverse, x, min(x + chunk, FIELD)));
+		worker->wait();
+	}
+
+	//average the real parts of data over each ring, the corners past FIELD/2 are left out
+	void radial(vector<double> & avg) const {
+		avg.assign(FIELD/2 + 2, 0.0);
+		for(int i = 0; i < FIELD*FIELD; i++)
+			avg[ring[i]] += data[i].real();
+		avg.resize(FIELD/2 + 1);
+		for(int r = 0; r <= FIELD/2; r++)
+			avg[r] /= ring_size[r];
+	}
+
+public:
+	//throws invalid_argument unless FIELD is a power of 2
+	PSD(){
+		if(FIELD & (FIELD - 1))
+			throw invalid_argument("The power spectrum needs FIELD to be a power of 2");
+
+		data = new cplx[FIELD*FIELD];
+
+		ring = new uint16_t[FIELD*FIELD];
+		ring_size.resize(FIELD/2 + 2, 0);
+		for(int y = 0; y < FIELD; y++){
+			int dy = (y <= FIELD/2 ? y : FIELD - y);
+			for(int x = 0; x < FIELD; x++){
+				int dx = (x <= FIELD/2 ? x : FIELD - x);
+				int r = min((int)(sqrt((double)(dx*dx + dy*dy)) + 0.5), FIELD/2 + 1);
+				ring[y*FIELD + x] = r;
+				ring_size[r]++;
+			}
+		}
+
+		for(int k = 0; k < FIELD/2; k++)
+			twiddle[k] = polar(1.0, -2*M_PI*k/FIELD);
+
+		FILE * fd = fopen("psdstats.csv", "w");
+		fprintf(fd, "time,rms roughness,correlation length\n");
+		fclose(fd);
+	}
+
+	~PSD(){
+		delete[] data;
+		delete[] ring;
+	}
+
+	void step(Worker * worker, int t, const Grid * grid, const vector<Grain> & grains){
+		double mean = 0;
+		for(int y = 0; y < FIELD; y++)
+			for(int x = 0; x < FIELD; x++)
+				mean += grid->heights[y][x];
+		mean /= FIELD*FIELD;
+
+		for(int y = 0; y < FIELD; y++)
+			for(int x = 0; x < FIELD; x++)
+				data[y*FIELD + x] = grid->heights[y][x] - mean;
+
+		transform(worker, false);
+
+		//scaled so the spectrum sums to the mean square roughness
+		double scale = 1.0/((double)FIELD*FIELD*FIELD*FIELD);
+		for(int i = 0; i < FIELD*FIELD; i++)
+			data[i] = norm(data[i]) * scale;
+
+		vector<double> psd, cov;
+		radial(psd);
+		transform(worker, true); //the autocovariance, unscaled since the spectrum already is
+		radial(cov);
+
+		double var = cov[0];
+		double length = 0;
+		for(int r = 1; r <= FIELD/2 && var > 0; r++){
+			if(cov[r] <= var/M_E){
+				length = r - 1 + (cov[r-1] - var/M_E)/(cov[r-1] - cov[r]);
+				break;
+			}
+		}
+
+		char filename[50];
+		sprintf(filename, "psd.%05d.csv", t);
+		FILE * fd = fopen(filename, "w");
+		fprintf(fd, "n,psd,hhcorrelation\n");
+		for(int n = 0; n <= FIELD/2; n++)
+			fprintf(fd, "%d,%g,%g\n", n, psd[n], 2*(var - cov[n]));
+		fclose(fd);
+
+		fd = fopen("psdstats.csv", "a");
+		fprintf(fd, "%d,%f,%f\n", t, sqrt(max(var, 0.0)), length);
+		fclose(fd);
+	}
+};
+
+#endif
+
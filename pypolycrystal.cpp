@@ -0,0 +1,562 @@
+
+//Python bindings for the simulator, built with make python. Use it like:
+//
+//  import polycrystal, numpy
+//  polycrystal.options(timestats=True)   # any of the opts flags, all off to start, batch=True keeps stdout quiet
+//  sim = polycrystal.Simulation(grains=400, steps=100, shape=6, threads=4)
+//  sim.init()
+//  while sim.step():
+//      h = numpy.asarray(sim.heights)    # (FIELD, FIELD) uint16, no copy
+//  sim.finish()
+//
+//Arrays come back as View objects holding a buffer, so numpy.asarray or memoryview read them in place. heights,
+//flux and sector point into the live simulation and are only good until the next step, layer, grains and faces
+//are copies. step releases the GIL so other python threads keep running while it grows.
+//A whole layer can't be one view since each sector is allocated on its own, sector gives the raw points of one.
+
+#include <Python.h>
+#include "polycrystal.h"
+
+
+//a block of memory exposed through the buffer protocol, either owned or kept alive by its owner
+struct View {
+	PyObject_HEAD
+	PyObject * owner; //NULL if data is our own copy
+	char * data;
+	int ndim;
+	Py_ssize_t shape[2];
+	Py_ssize_t strides[2];
+	Py_ssize_t itemsize;
+	const char * format;
+};
+
+static void view_dealloc(View * self){
+	if(self->owner)
+		Py_DECREF(self->owner);
+	else
+		free(self->data);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int view_getbuffer(View * self, Py_buffer * b, int flags){
+	if(flags & PyBUF_WRITABLE){
+		PyErr_SetString(PyExc_BufferError, "polycrystal views are read only");
+		return -1;
+	}
+	b->buf = self->data;
+	b->obj = (PyObject *)self;
+	Py_INCREF(self);
+	b->len = self->itemsize;
+	for(int i = 0; i < self->ndim; i++)
+		b->len *= self->shape[i];
+	b->readonly = 1;
+	b->itemsize = self->itemsize;
+	b->format = (flags & PyBUF_FORMAT ? (char *)self->format : NULL);
+	b->ndim = self->ndim;
+	b->shape = self->shape;
+	b->strides = self->strides;
+	b->suboffsets = NULL;
+	b->internal = NULL;
+	return 0;
+}
+
+static PyBufferProcs view_buffer = { (getbufferproc)view_getbuffer, NULL };
+
+static PyTypeObject ViewType = { PyVarObject_HEAD_INIT(NULL, 0) "polycrystal.View" };
+
+//a 1d or 2d row major view of data, rows of 0 for 1d
+static PyObject * new_view(PyObject * owner, const void * data, Py_ssize_t rows, Py_ssize_t cols, Py_ssize_t itemsize, const char * format){
+	View * v = PyObject_New(View, &ViewType);
+	if(!v)
+		return NULL;
+	v->owner = owner;
+	if(owner)
+		Py_INCREF(owner);
+	v->data = (char *)data;
+	v->itemsize = itemsize;
+	v->format = format;
+	if(rows){
+		v->ndim = 2;
+		v->shape[0] = rows;
+		v->shape[1] = cols;
+		v->strides[0] = cols*itemsize;
+		v->strides[1] = itemsize;
+	}else{
+		v->ndim = 1;
+		v->shape[0] = cols;
+		v->strides[0] = itemsize;
+	}
+	return (PyObject *)v;
+}
+
+//a view that takes ownership of malloc'd data
+static PyObject * owned_view(void * data, Py_ssize_t rows, Py_ssize_t cols, Py_ssize_t itemsize, const char * format){
+	PyObject * v = new_view(NULL, data, rows, cols, itemsize, format);
+	if(!v)
+		free(data);
+	return v;
+}
+
+
+#define POINT_FORMAT "T{H:time:H:grain:B:face:B:diffprob:}"
+
+struct GrainRecord {
+	int64_t x, y, z, size, growth, threats;
+	double theta1, theta2, phi;
+};
+#define GRAIN_FORMAT "T{q:x:q:y:q:z:q:size:q:growth:q:threats:d:theta1:d:theta2:d:phi:}"
+
+struct FaceRecord {
+	int64_t grain, face, flux, threats, growth;
+	double a, b, c, D, F, dF, K, P;
+};
+#define FACE_FORMAT "T{q:grain:q:face:q:flux:q:threats:q:growth:d:a:d:b:d:c:d:D:d:F:d:dF:d:K:d:P:}"
+
+
+//keyword names for the Config fields, the long command line option names where there is one
+struct IntParam    { const char * name; int    Config::*field; };
+struct DoubleParam { const char * name; double Config::*field; };
+struct BoolParam   { const char * name; bool   Config::*field; };
+
+static const IntParam int_params[] = {
+	{ "steps",     &Config::num_steps },
+	{ "grains",    &Config::num_grains },
+	{ "endgrains", &Config::end_grains },
+	{ "raystep",   &Config::ray_step },
+	{ "shape",     &Config::shape_id },
+	{ "threads",   &Config::threads },
+	{ "memory",    &Config::max_memory },
+	{ NULL, NULL } };
+
+static const DoubleParam double_params[] = {
+	{ "factor",    &Config::growth_factor },
+	{ "adaptive",  &Config::adaptive },
+	{ "startangle",&Config::start_angle },
+	{ "sep",       &Config::min_dist },
+	{ "rayratio",  &Config::ray_ratio },
+	{ "angleconst",&Config::ray_angle },
+	{ "cutoff",    &Config::ray_cutoff },
+	{ "diffusion", &Config::diffusion },
+	{ NULL, NULL } };
+
+static const BoolParam bool_params[] = {
+	{ "subdiff",   &Config::substrate_diffusion },
+	{ "horizon",   &Config::horizon },
+	{ "sobol",     &Config::sobol },
+	{ "jumprays",  &Config::jumprays },
+	{ "facewalk",  &Config::facewalk },
+	{ "load",      &Config::load_data },
+	{ NULL, NULL } };
+
+//the output flags, interrupt is internal
+struct OptionFlag { const char * name; bool Options::*field; };
+
+static const OptionFlag option_flags[] = {
+	{ "cmdline",    &Options::cmdline },
+	{ "console",    &Options::console },
+	{ "timestats",  &Options::timestats },
+	{ "layerstats", &Options::layerstats },
+	{ "slopemap",   &Options::slopemap },
+	{ "isomorphic", &Options::isomorphic },
+	{ "surf3d",     &Options::surf3d },
+	{ "perspective",&Options::perspective },
+	{ "heightmap",  &Options::heightmap },
+	{ "heightdump", &Options::heightdump },
+	{ "timemap",    &Options::timemap },
+	{ "fluxdump",   &Options::fluxdump },
+	{ "peaks",      &Options::peaks },
+	{ "tracks",     &Options::tracks },
+	{ "psd",        &Options::psd },
+	{ "texture",    &Options::texture },
+	{ "events",     &Options::events },
+	{ "layermap",   &Options::layermap },
+	{ "grainstats", &Options::grainstats },
+	{ "voronei",    &Options::voronei },
+	{ "graininit",  &Options::graininit },
+	{ "growth",     &Options::growth },
+	{ "datadump",   &Options::datadump },
+	{ "savemem",    &Options::savemem },
+	{ "pockets",    &Options::pockets },
+	{ "randcolor",  &Options::randcolor },
+	{ "batch",      &Options::batch },
+	{ NULL, NULL } };
+
+//set one keyword on c, false with an exception set if it's unknown or the wrong type
+static bool set_param(Config & c, const char * name, PyObject * value){
+	for(const IntParam * p = int_params; p->name; p++){
+		if(strcmp(name, p->name) == 0){
+			long v = PyLong_AsLong(value);
+			if(v == -1 && PyErr_Occurred())
+				return false;
+			c.*(p->field) = v;
+			return true;
+		}
+	}
+	for(const DoubleParam * p = double_params; p->name; p++){
+		if(strcmp(name, p->name) == 0){
+			double v = PyFloat_AsDouble(value);
+			if(v == -1.0 && PyErr_Occurred())
+				return false;
+			c.*(p->field) = v;
+			return true;
+		}
+	}
+	for(const BoolParam * p = bool_params; p->name; p++){
+		if(strcmp(name, p->name) == 0){
+			int v = PyObject_IsTrue(value);
+			if(v == -1)
+				return false;
+			c.*(p->field) = v;
+			return true;
+		}
+	}
+	PyErr_Format(PyExc_TypeError, "Unknown Simulation option %s", name);
+	return false;
+}
+
+
+struct PySimulation {
+	PyObject_HEAD
+	Simulation * sim;
+	bool stepping; //a step is running with the GIL released
+};
+
+static int sim_init(PySimulation * self, PyObject * args, PyObject * kwargs){
+	//views into the old simulation would be left pointing at freed memory
+	if(self->sim){
+		PyErr_SetString(PyExc_RuntimeError, "Simulation is already initialized");
+		return -1;
+	}
+	if(PyTuple_Size(args)){
+		PyErr_SetString(PyExc_TypeError, "Simulation only takes keyword arguments");
+		return -1;
+	}
+
+	Config c;
+
+	PyObject * key, * value;
+	Py_ssize_t pos = 0;
+	while(kwargs && PyDict_Next(kwargs, &pos, &key, &value)){
+		const char * name = PyUnicode_AsUTF8(key);
+		if(!name || !set_param(c, name, value))
+			return -1;
+	}
+
+	if(!find_shape(c.shape_id)){
+		PyErr_Format(PyExc_ValueError, "Unknown shape %d", c.shape_id);
+		return -1;
+	}
+	if(c.threads < 1 || c.threads > MAX_THREADS){
+		PyErr_Format(PyExc_ValueError, "threads must be 1 to %d", MAX_THREADS);
+		return -1;
+	}
+	if(c.num_grains < 1 || c.num_grains >= MAXGRAIN){
+		PyErr_Format(PyExc_ValueError, "grains must be 1 to %d", MAXGRAIN - 1);
+		return -1;
+	}
+
+	try{
+		self->sim = new Simulation(c);
+	}catch(invalid_argument & e){
+		PyErr_SetString(PyExc_ValueError, e.what());
+		return -1;
+	}
+	self->stepping = false;
+	return 0;
+}
+
+static void sim_dealloc(PySimulation * self){
+	delete self->sim;
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+//the simulation, or NULL with an exception set if it isn't usable right now
+static Simulation * get_sim(PySimulation * self){
+	if(!self->sim){
+		PyErr_SetString(PyExc_RuntimeError, "Simulation was never initialized");
+		return NULL;
+	}
+	if(self->stepping){
+		PyErr_SetString(PyExc_RuntimeError, "Simulation is in the middle of a step");
+		return NULL;
+	}
+	return self->sim;
+}
+
+static PyObject * sim_initgrains(PySimulation * self, PyObject *){
+	Simulation * sim = get_sim(self);
+	if(!sim)
+		return NULL;
+	try{
+		sim->init();
+	}catch(logic_error & e){
+		PyErr_SetString(PyExc_RuntimeError, e.what());
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject * sim_step(PySimulation * self, PyObject *){
+	Simulation * sim = get_sim(self);
+	if(!sim)
+		return NULL;
+
+	bool more = false;
+	string err;
+	self->stepping = true;
+	Py_BEGIN_ALLOW_THREADS
+	try{
+		more = sim->step();
+	}catch(logic_error & e){
+		err = e.what();
+	}
+	Py_END_ALLOW_THREADS
+	self->stepping = false;
+
+	if(err.size()){
+		PyErr_SetString(PyExc_RuntimeError, err.c_str());
+		return NULL;
+	}
+	return PyBool_FromLong(more);
+}
+
+static PyObject * sim_finish(PySimulation * self, PyObject *){
+	Simulation * sim = get_sim(self);
+	if(!sim)
+		return NULL;
+	string err;
+	self->stepping = true;
+	Py_BEGIN_ALLOW_THREADS
+	try{
+		sim->finish();
+	}catch(logic_error & e){
+		err = e.what();
+	}
+	Py_END_ALLOW_THREADS
+	self->stepping = false;
+
+	if(err.size()){
+		PyErr_SetString(PyExc_RuntimeError, err.c_str());
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject * sim_run(PySimulation * self, PyObject *){
+	Simulation * sim = get_sim(self);
+	if(!sim)
+		return NULL;
+	string err;
+	self->stepping = true;
+	Py_BEGIN_ALLOW_THREADS
+	try{
+		sim->run();
+	}catch(logic_error & e){
+		err = e.what();
+	}
+	Py_END_ALLOW_THREADS
+	self->stepping = false;
+
+	if(err.size()){
+		PyErr_SetString(PyExc_RuntimeError, err.c_str());
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+//the raw points of sector s of layer z, or None if it isn't held
+static PyObject * sim_sector(PySimulation * self, PyObject * args){
+	int z, s;
+	if(!PyArg_ParseTuple(args, "ii", &z, &s))
+		return NULL;
+	Simulation * sim = get_sim(self);
+	if(!sim)
+		return NULL;
+
+	const Point * points = sim->sector(z, s);
+	if(!points)
+		Py_RETURN_NONE;
+	return new_view((PyObject *)self, points, 0, FIELD, sizeof(Point), POINT_FORMAT);
+}
+
+//a copy of layer z in row order, empty points where nothing is allocated. Full sectors dropped to disk read as FULLPOINT
+static PyObject * sim_layer(PySimulation * self, PyObject * args){
+	int z;
+	if(!PyArg_ParseTuple(args, "i", &z))
+		return NULL;
+	Simulation * sim = get_sim(self);
+	if(!sim)
+		return NULL;
+	if(z < sim->zmin() || z >= sim->zmax()){
+		PyErr_Format(PyExc_IndexError, "Layer %d isn't held, only %d to %d are", z, sim->zmin(), sim->zmax() - 1);
+		return NULL;
+	}
+
+	Point * data = (Point *)malloc(sizeof(Point)*FIELD*FIELD);
+	if(!data)
+		return PyErr_NoMemory();
+	for(int y = 0; y < FIELD; y++)
+		for(int x = 0; x < FIELD; x++)
+			data[y*FIELD + x] = *(sim->point(x, y, z));
+	return owned_view(data, FIELD, FIELD, sizeof(Point), POINT_FORMAT);
+}
+
+//one record per grain, indexed by grain id, so grain 0 is the blank one
+static PyObject * sim_grains(PySimulation * self, PyObject *){
+	Simulation * sim = get_sim(self);
+	if(!sim)
+		return NULL;
+
+	const vector<Grain> & grains = sim->grains();
+	GrainRecord * data = (GrainRecord *)malloc(sizeof(GrainRecord)*max((size_t)1, grains.size()));
+	if(!data)
+		return PyErr_NoMemory();
+	for(unsigned int i = 0; i < grains.size(); i++){
+		const Grain & g = grains[i];
+		GrainRecord r = { g.x, g.y, g.z, g.size, g.growth, g.threats, g.theta1, g.theta2, g.phi };
+		data[i] = r;
+	}
+	return owned_view(data, 0, grains.size(), sizeof(GrainRecord), GRAIN_FORMAT);
+}
+
+//one record per face of every grain, with its direction and counters
+static PyObject * sim_faces(PySimulation * self, PyObject *){
+	Simulation * sim = get_sim(self);
+	if(!sim)
+		return NULL;
+
+	const vector<Grain> & grains = sim->grains();
+	size_t n = 0;
+	for(unsigned int i = 1; i < grains.size(); i++)
+		n += grains[i].faces.size();
+
+	FaceRecord * data = (FaceRecord *)malloc(sizeof(FaceRecord)*max((size_t)1, n));
+	if(!data)
+		return PyErr_NoMemory();
+	FaceRecord * r = data;
+	for(unsigned int i = 1; i < grains.size(); i++){
+		for(unsigned int j = 0; j < grains[i].faces.size(); j++){
+			const Face & f = grains[i].faces[j];
+			FaceRecord rec = { i, j, f.flux, f.threats, f.growth, f.vec.a, f.vec.b, f.vec.c, f.D, f.F, f.dF, f.K, f.P };
+			*r++ = rec;
+		}
+	}
+	return owned_view(data, 0, n, sizeof(FaceRecord), FACE_FORMAT);
+}
+
+static PyObject * sim_heights(PySimulation * self, void *){
+	Simulation * sim = get_sim(self);
+	if(!sim)
+		return NULL;
+	return new_view((PyObject *)self, sim->heights(), FIELD, FIELD, sizeof(uint16_t), "H");
+}
+
+static PyObject * sim_flux(PySimulation * self, void *){
+	Simulation * sim = get_sim(self);
+	if(!sim)
+		return NULL;
+	return new_view((PyObject *)self, sim->flux(), FIELD, FIELD, sizeof(uint8_t), "B");
+}
+
+static PyObject * sim_time(PySimulation * self, void *){
+	Simulation * sim = get_sim(self);
+	return (sim ? PyLong_FromLong(sim->time()) : NULL);
+}
+
+static PyObject * sim_zmin(PySimulation * self, void *){
+	Simulation * sim = get_sim(self);
+	return (sim ? PyLong_FromLong(sim->zmin()) : NULL);
+}
+
+static PyObject * sim_zmax(PySimulation * self, void *){
+	Simulation * sim = get_sim(self);
+	return (sim ? PyLong_FromLong(sim->zmax()) : NULL);
+}
+
+static PyMethodDef sim_methods[] = {
+	{ "init",   (PyCFunction)sim_initgrains, METH_NOARGS,  "Place the grains on the substrate" },
+	{ "step",   (PyCFunction)sim_step,       METH_NOARGS,  "Run the next timestep without the GIL, False once the run is over" },
+	{ "finish", (PyCFunction)sim_finish,     METH_NOARGS,  "Output the layers still held" },
+	{ "run",    (PyCFunction)sim_run,        METH_NOARGS,  "Step to the end and finish" },
+	{ "sector", (PyCFunction)sim_sector,     METH_VARARGS, "sector(z, s): live view of the FIELD points of sector s of layer z, None if not held" },
+	{ "layer",  (PyCFunction)sim_layer,      METH_VARARGS, "layer(z): copy of the points of layer z, (FIELD, FIELD) in row order" },
+	{ "grains", (PyCFunction)sim_grains,     METH_NOARGS,  "Copy of the grain records, indexed by grain id" },
+	{ "faces",  (PyCFunction)sim_faces,      METH_NOARGS,  "Copy of the face records of every grain" },
+	{ NULL } };
+
+static PyGetSetDef sim_getset[] = {
+	{ (char *)"heights", (getter)sim_heights, NULL, (char *)"Live (FIELD, FIELD) uint16 view of the column heights, [y][x]", NULL },
+	{ (char *)"flux",    (getter)sim_flux,    NULL, (char *)"Live (FIELD, FIELD) uint8 view of the flux landed per column, only counted with fluxdump", NULL },
+	{ (char *)"time",    (getter)sim_time,    NULL, (char *)"Current timestep", NULL },
+	{ (char *)"zmin",    (getter)sim_zmin,    NULL, (char *)"Lowest layer held", NULL },
+	{ (char *)"zmax",    (getter)sim_zmax,    NULL, (char *)"One past the highest layer held", NULL },
+	{ NULL } };
+
+static PyTypeObject SimulationType = { PyVarObject_HEAD_INIT(NULL, 0) "polycrystal.Simulation" };
+
+
+//set output flags by keyword, eg options(timestats=True, layerstats=True)
+static PyObject * set_options(PyObject *, PyObject * args, PyObject * kwargs){
+	if(PyTuple_Size(args)){
+		PyErr_SetString(PyExc_TypeError, "options only takes keyword arguments");
+		return NULL;
+	}
+
+	PyObject * key, * value;
+	Py_ssize_t pos = 0;
+	while(kwargs && PyDict_Next(kwargs, &pos, &key, &value)){
+		const char * name = PyUnicode_AsUTF8(key);
+		if(!name)
+			return NULL;
+		const OptionFlag * f = option_flags;
+		while(f->name && strcmp(name, f->name) != 0)
+			f++;
+		if(!f->name){
+			PyErr_Format(PyExc_TypeError, "Unknown output option %s", name);
+			return NULL;
+		}
+		int v = PyObject_IsTrue(value);
+		if(v == -1)
+			return NULL;
+		opts.*(f->field) = v;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef module_methods[] = {
+	{ "options", (PyCFunction)(void (*)(void))set_options, METH_VARARGS | METH_KEYWORDS, "Set output options by keyword, all off to start" },
+	{ NULL } };
+
+static PyModuleDef module = { PyModuleDef_HEAD_INIT, "polycrystal", "Polycrystalline thin film growth simulator", -1, module_methods };
+
+PyMODINIT_FUNC PyInit_polycrystal(){
+	ViewType.tp_basicsize = sizeof(View);
+	ViewType.tp_dealloc = (destructor)view_dealloc;
+	ViewType.tp_as_buffer = &view_buffer;
+	ViewType.tp_flags = Py_TPFLAGS_DEFAULT;
+	ViewType.tp_doc = "Read only buffer of simulation data, pass it to numpy.asarray or memoryview";
+	if(PyType_Ready(&ViewType) < 0)
+		return NULL;
+
+	SimulationType.tp_basicsize = sizeof(PySimulation);
+	SimulationType.tp_dealloc = (destructor)sim_dealloc;
+	SimulationType.tp_flags = Py_TPFLAGS_DEFAULT;
+	SimulationType.tp_doc = "Simulation(**options), takes the long command line option names: grains, steps, shape, threads, ...";
+	SimulationType.tp_methods = sim_methods;
+	SimulationType.tp_getset = sim_getset;
+	SimulationType.tp_init = (initproc)sim_init;
+	SimulationType.tp_new = PyType_GenericNew;
+	if(PyType_Ready(&SimulationType) < 0)
+		return NULL;
+
+	PyObject * m = PyModule_Create(&module);
+	if(!m)
+		return NULL;
+
+	Py_INCREF(&ViewType);
+	PyModule_AddObject(m, "View", (PyObject *)&ViewType);
+	Py_INCREF(&SimulationType);
+	PyModule_AddObject(m, "Simulation", (PyObject *)&SimulationType);
+	PyModule_AddIntConstant(m, "FIELD", FIELD);
+	return m;
+}
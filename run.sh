@@ -2,6 +2,8 @@
 
 OPTS="-m 6500 -n 10000 -g 10000 --peaks --graininit --voronei --savemem"
 
-./crystal $OPTS -d long14 -s 14
-./crystal $OPTS -d long6  -s 6
-
+#one process for both, so they share the grain placements
+./crystal $OPTS -d . --batch /dev/stdin <<END
+-d long14 -s 14
+-d long6  -s 6
+END
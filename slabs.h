@@ -0,0 +1,226 @@
+
+#ifndef _SLABS_H_
+#define _SLABS_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <errno.h>
+
+//A run split over several processes on one machine, each owning a slab of rows of the field. They are all forked
+//from the first before any threads start, and talk over unix sockets, one socket pair between each two of them.
+//Every collective call must be made by all the slabs in the same order.
+class Slabs {
+	vector<int> fds; //socket to each other slab, -1 for this one
+	vector<pid_t> children;
+	int align;
+
+	void lost(int r){
+		printf("Lost contact with slab %d\n", r);
+		exit(1);
+	}
+
+	void write_all(int r, const void * buf, size_t len){
+		const char * p = (const char *)buf;
+		while(len){
+			ssize_t n = send(fds[r], p, len, MSG_NOSIGNAL);
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n <= 0)
+				lost(r);
+			p += n;
+			len -= n;
+		}
+	}
+
+	void read_all(int r, void * buf, size_t len){
+		char * p = (char *)buf;
+		while(len){
+			ssize_t n = recv(fds[r], p, len, 0);
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n <= 0)
+				lost(r);
+			p += n;
+			len -= n;
+		}
+	}
+
+	//send to one slab while receiving from another, so a ring of big messages can't fill the buffers and deadlock
+	void sendrecv(int to, const void * out, size_t outlen, int from, void * in, size_t inlen){
+		const char * o = (const char *)out;
+		char * i = (char *)in;
+
+		while(outlen || inlen){
+			struct pollfd p[2];
+			int n = 0;
+			if(outlen){ p[n].fd = fds[to];   p[n].events = POLLOUT; n++; }
+			if(inlen) { p[n].fd = fds[from]; p[n].events = POLLIN;  n++; }
+
+			if(poll(p, n, -1) < 0){
+				if(errno == EINTR)
+					continue;
+				printf("Couldn't wait on the sockets between slabs\n");
+				exit(1);
+			}
+
+			if(outlen && (p[0].revents & (POLLOUT | POLLERR | POLLHUP))){
+				ssize_t r = send(fds[to], o, outlen, MSG_DONTWAIT | MSG_NOSIGNAL);
+				if(r < 0 && errno != EAGAIN && errno != EINTR)
+					lost(to);
+				if(r > 0){
+					o += r;
+					outlen -= r;
+				}
+			}
+			if(inlen && (p[n-1].revents & (POLLIN | POLLERR | POLLHUP))){
+				ssize_t r = recv(fds[from], i, inlen, MSG_DONTWAIT);
+				if(r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR))
+					lost(from);
+				if(r > 0){
+					i += r;
+					inlen -= r;
+				}
+			}
+		}
+	}
+
+	enum Op { SUM, MIN, MAX };
+
+	//combine vals over all the slabs, through the first
+	void reduce(int64_t * vals, int n, Op op){
+		if(rank){
+			write_all(0, vals, n*sizeof(int64_t));
+			read_all(0, vals, n*sizeof(int64_t));
+			return;
+		}
+
+		vector<int64_t> other(n);
+		for(int r = 1; r < num; r++){
+			read_all(r, &other[0], n*sizeof(int64_t));
+			for(int i = 0; i < n; i++){
+				switch(op){
+					case SUM: vals[i] += other[i];                   break;
+					case MIN: vals[i] = std::min(vals[i], other[i]); break;
+					case MAX: vals[i] = std::max(vals[i], other[i]); break;
+				}
+			}
+		}
+		for(int r = 1; r < num; r++)
+			write_all(r, vals, n*sizeof(int64_t));
+	}
+
+public:
+	int rank, num;
+	int ybegin, yend; //rows owned by this slab
+
+	//fork into n slabs, returning in each with its own rank. Slab edges fall on multiples of Align rows
+	Slabs(int n, int Align){
+		num = n;
+		align = Align;
+
+		vector<int> pairs(num*num, -1); //pairs[a*num + b] is a's end of the socket to b
+		for(int a = 0; a < num; a++){
+			for(int b = a + 1; b < num; b++){
+				int sv[2];
+				if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1){
+					printf("Couldn't create the sockets between slabs\n");
+					exit(1);
+				}
+				pairs[a*num + b] = sv[0];
+				pairs[b*num + a] = sv[1];
+			}
+		}
+
+		rank = 0;
+		for(int r = 1; r < num; r++){
+			pid_t pid = fork();
+			if(pid == -1){
+				printf("Couldn't start slab %d\n", r);
+				exit(1);
+			}
+			if(pid == 0){
+				rank = r;
+				children.clear();
+				break;
+			}
+			children.push_back(pid);
+		}
+
+		//keep only this slab's ends
+		fds.resize(num, -1);
+		for(int a = 0; a < num; a++){
+			for(int b = 0; b < num; b++){
+				if(pairs[a*num + b] == -1)
+					continue;
+				if(a == rank)
+					fds[b] = pairs[a*num + b];
+				else
+					close(pairs[a*num + b]);
+			}
+		}
+
+		ybegin = begin(rank);
+		yend = begin(rank + 1);
+	}
+
+	//wait for the other slabs to finish, only the first has any to wait for
+	~Slabs(){
+		for(unsigned int i = 0; i < children.size(); i++)
+			waitpid(children[i], NULL, 0);
+		for(int r = 0; r < num; r++)
+			if(fds[r] != -1)
+				close(fds[r]);
+	}
+
+	//first row of slab r
+	int begin(int r) const {
+		return (FIELD/align * r / num) * align;
+	}
+
+	//slab that owns row y, y in 0 to FIELD
+	int owner(int y) const {
+		int r = num - 1;
+		while(y < begin(r))
+			r--;
+		return r;
+	}
+
+	void sum(int64_t * vals, int n){ reduce(vals, n, SUM); }
+	int64_t sum(int64_t v){ reduce(&v, 1, SUM); return v; }
+	int64_t min(int64_t v){ reduce(&v, 1, MIN); return v; }
+	int64_t max(int64_t v){ reduce(&v, 1, MAX); return v; }
+
+	//send out[r] to each slab r, and collect what the others sent to this one in in. out is left empty
+	template <class T> void exchange(vector<T> * out, vector<T> & in){
+		in.clear();
+		in.swap(out[rank]);
+		for(int s = 1; s < num; s++){
+			int to = (rank + s) % num;
+			int from = (rank - s + num) % num;
+
+			uint64_t outlen = out[to].size(), inlen = 0;
+			sendrecv(to, &outlen, sizeof(outlen), from, &inlen, sizeof(inlen));
+
+			size_t old = in.size();
+			in.resize(old + inlen);
+			sendrecv(to, (outlen ? &out[to][0] : NULL), outlen*sizeof(T), from, (inlen ? &in[old] : NULL), inlen*sizeof(T));
+			out[to].clear();
+		}
+		out[rank].clear();
+	}
+
+	//copy each slab's own rows of a field wide array to all the others
+	template <class T> void gather_rows(T (*rows)[FIELD]){
+		for(int s = 1; s < num; s++){
+			int to = (rank + s) % num;
+			int from = (rank - s + num) % num;
+			sendrecv(to, rows[ybegin], (yend - ybegin)*sizeof(rows[0]),
+			         from, rows[begin(from)], (begin(from + 1) - begin(from))*sizeof(rows[0]));
+		}
+	}
+};
+
+#endif
+
@@ -0,0 +1,387 @@
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <unistd.h>
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+#include <pthread.h>
+#include "gd.h"
+
+using namespace std;
+
+#ifndef FIELD
+#define FIELD (1<<10) //default size of the layers, same as crystal
+#endif
+
+#ifndef MAX_THREADS
+#define MAX_THREADS 100
+#endif
+
+#include "color.h"
+#include "coord.h"
+#include "point.h"
+#include "worker.h"
+
+/*
+ * Cross sections and projections of the binary layer dumps written by --datadump.
+ * Layers are streamed in z order, one layer per request, and every slice takes what it needs from each
+ * layer as it goes by, so any number of slices are rendered in a single pass over the data.
+ */
+
+struct Slice {
+	char name[50];
+	int size;   //size of a layer
+	int width, height;
+
+	Slice(int s) : size(s) { }
+	virtual ~Slice() { }
+
+	//take what's needed from layer z, each pixel only depends on one layer so layers can run in parallel
+	virtual void layer(int z, const Point * points) = 0;
+
+	virtual void save(const vector<RGB> & colors, bool raw) = 0;
+
+	void savepng(gdImagePtr im){
+		char filename[60];
+		sprintf(filename, "%s.png", name);
+		FILE * fd = fopen(filename, "wb");
+		gdImagePng(im, fd);
+		fclose(fd);
+		gdImageDestroy(im);
+	}
+};
+
+//a slice that stores the grain id per pixel
+struct GrainSlice : Slice {
+	vector<uint16_t> grains;
+
+	GrainSlice(int s) : Slice(s) { }
+
+	void save(const vector<RGB> & colors, bool raw){
+		gdImagePtr im = gdImageCreateTrueColor(width, height);
+		gdImageFill(im, 0, 0, gdImageColorAllocate(im, 0, 0, 0));
+
+		for(int y = 0; y < height; y++){
+			for(int x = 0; x < width; x++){
+				uint16_t grain = grains[y*width + x];
+				if(grain != 0 && grain < MAXGRAIN){
+					RGB rgb = colors[grain];
+					gdImageSetPixel(im, x, y, gdImageColorAllocate(im, rgb.r, rgb.g, rgb.b));
+				}
+			}
+		}
+		savepng(im);
+
+		if(raw){
+			char filename[60];
+			sprintf(filename, "%s.dat", name);
+			FILE * fd = fopen(filename, "wb");
+			if(fwrite(&grains[0], sizeof(uint16_t), grains.size(), fd));
+			fclose(fd);
+		}
+	}
+};
+
+//a vertical slice along a line through the layers, layer z ends up on row height - z - 1
+struct VerticalSlice : GrainSlice {
+	vector<int> index; //index into a layer for each column
+
+	VerticalSlice(int s, int layers, double x, double y, double angle, const char * n) : GrainSlice(s) {
+		strcpy(name, n);
+		width = size;
+		height = layers;
+		grains.resize(width*height, 0);
+
+		double dx = cos(angle*M_PI/180), dy = sin(angle*M_PI/180);
+		for(int i = 0; i < width; i++){
+			int X = ((int)floor(x + dx*i + 0.5) % size + size) % size;
+			int Y = ((int)floor(y + dy*i + 0.5) % size + size) % size;
+			index.push_back(Y*size + X);
+		}
+	}
+
+	void layer(int z, const Point * points){
+		uint16_t * row = &grains[(height - z - 1)*width];
+		for(int i = 0; i < width; i++)
+			row[i] = points[index[i]].grain;
+	}
+};
+
+//an arbitrary plane through a point, size x size pixels, sampled at the nearest point
+struct PlaneSlice : GrainSlice {
+	vector< vector< pair<int, int> > > samples; //for each layer, which pixels come from which index in that layer
+
+	PlaneSlice(int s, int layers, Coord3f c, Coord3f n, const char * nm) : GrainSlice(s) {
+		strcpy(name, nm);
+		width = height = size;
+		grains.resize(width*height, 0);
+		samples.resize(layers);
+
+		n.scale();
+		Coord3f u = (fabs(n.z) > 0.999 ? Coord3f(1, 0, 0) : n.cross(Coord3f(0, 0, 1)).scale());
+		Coord3f v = u.cross(n);
+		if(v.z < 0) //keep up as up when possible
+			v = -v;
+
+		for(int j = 0; j < height; j++){
+			for(int i = 0; i < width; i++){
+				Coord3f p = c + u*(i - width/2) + v*(height/2 - j);
+				int z = (int)floor(p.z + 0.5);
+				if(z < 0 || z >= layers)
+					continue;
+				int X = ((int)floor(p.x + 0.5) % size + size) % size;
+				int Y = ((int)floor(p.y + 0.5) % size + size) % size;
+				samples[z].push_back(make_pair(j*width + i, Y*size + X));
+			}
+		}
+	}
+
+	void layer(int z, const Point * points){
+		for(vector< pair<int, int> >::iterator s = samples[z].begin(); s != samples[z].end(); ++s)
+			grains[s->first] = points[s->second].grain;
+	}
+};
+
+//the colour averaged along x or y through the whole field, empty space counts as black
+struct Projection : Slice {
+	int axis; //0 for x, 1 for y
+	const vector<RGB> & colors;
+	vector<double> sums; //r,g,b per pixel
+
+	Projection(int s, int layers, int a, const vector<RGB> & c) : Slice(s), axis(a), colors(c) {
+		sprintf(name, "project.%c", (axis ? 'y' : 'x'));
+		width = size;
+		height = layers;
+		sums.resize(width*height*3, 0);
+	}
+
+	void layer(int z, const Point * points){
+		double * row = &sums[(height - z - 1)*width*3];
+		for(int d = 0; d < size; d++){
+			for(int i = 0; i < width; i++){
+				uint16_t grain = (axis ? points[d*size + i].grain : points[i*size + d].grain);
+				if(grain != 0 && grain < MAXGRAIN){
+					row[i*3 + 0] += colors[grain].r;
+					row[i*3 + 1] += colors[grain].g;
+					row[i*3 + 2] += colors[grain].b;
+				}
+			}
+		}
+	}
+
+	void save(const vector<RGB> & colors, bool raw){
+		gdImagePtr im = gdImageCreateTrueColor(width, height);
+		for(int y = 0; y < height; y++){
+			for(int x = 0; x < width; x++){
+				double * s = &sums[(y*width + x)*3];
+				gdImageSetPixel(im, x, y, gdImageColorAllocate(im, (int)(s[0]/size), (int)(s[1]/size), (int)(s[2]/size)));
+			}
+		}
+		savepng(im);
+	}
+};
+
+struct LayerReq : WorkRequest {
+	int z, size;
+	vector<Slice *> * slices;
+
+	LayerReq(int Z, int S, vector<Slice *> * s) : z(Z), size(S), slices(s) { }
+
+	int64_t run(){
+		char filename[50];
+		sprintf(filename, "data.%05d.dat", z);
+		FILE * fd = fopen(filename, "rb");
+		if(fd == NULL)
+			return 0;
+
+		vector<Point> points(size*size);
+		if(fread(&points[0], sizeof(Point), size*size, fd) != (size_t)(size*size)){
+			printf("File %s is not the expected size\n", filename);
+			exit(1);
+		}
+		fclose(fd);
+
+		for(unsigned int i = 0; i < slices->size(); i++)
+			(*slices)[i]->layer(z, &points[0]);
+
+		return 1;
+	}
+};
+
+//colour each grain the same way crystal does, using grains.csv if it's there
+vector<RGB> grain_colors(bool randcolor){
+	vector<RGB> colors(MAXGRAIN);
+	for(int i = 0; i < MAXGRAIN; i++) //a spread of hues in case there is no grains.csv
+		colors[i] = RGB(HSV(fmod(i*0.618033988749895, 1.0), 1.0, 1.0));
+
+	FILE * fd = fopen("grains.csv", "r");
+	if(fd == NULL)
+		return colors;
+
+	char buf[100];
+	if(fgets(buf, 99, fd)); //ignore the header
+
+	vector<double> hues;
+	int i, x, y;
+	double theta1, theta2, phi;
+	while(fscanf(fd, "%d,%d,%d,%lf,%lf,%lf\n", &i, &x, &y, &theta1, &theta2, &phi) == 6)
+		hues.push_back(directional_hue(theta1, phi));
+	fclose(fd);
+
+	for(unsigned int j = 0; j < hues.size() && j + 1 < MAXGRAIN; j++)
+		colors[j + 1] = RGB(HSV((randcolor ? (double)(j + 1)/hues.size() : hues[j]), 1.0, 1.0));
+
+	return colors;
+}
+
+//a slice as given on the command line
+struct Spec {
+	char type;
+	double a[6];
+};
+
+int main(int argc, char **argv){
+	int size = FIELD;
+	int height = 65000;
+	int threads = min(4, MAX_THREADS);
+	bool raw = false;
+	bool randcolor = false;
+
+	vector<Spec> specs; //slices are built after the layer count is known
+
+	for(unsigned int i = 1; i < (unsigned int)argc; i++){
+		char * ptr = argv[i];
+		if(strcmp(ptr, "-h") == 0 || strcmp(ptr, "--help") == 0){
+			printf("Usage: %s <options> <slices>\n"
+				"Ex: %s -d data -y 100 -y 200 -o 0,0,30 -P y\n"
+				"\t-h --help       Show this help\n"
+				"\t-d --dir        Directory with the data.%%05d.dat files from --datadump [./]\n"
+				"\t-s --size       Size of the layers [%d]\n"
+ 				"\t-H --height     Max Height [all layers]\n"
+ 				"\t-t --threads    Number of threads reading layers [%d]\n"
+ 				"\t-r --raw        Also output the grain ids of each slice to <slice>.dat as uint16\n"
+				"\t   --randcolor  Use random grain coloring, like crystal --randcolor\n"
+				"Slices, as many as wanted, all done in one pass over the layers:\n"
+				"\t-x <x>              y-z section at x                     to slice.x.%%05d.png\n"
+				"\t-y <y>              x-z section at y                     to slice.y.%%05d.png\n"
+				"\t-o <x,y,angle>      vertical section through x,y at an angle in degrees from the x axis to slice.o.%%d.png\n"
+				"\t-p <x,y,z,nx,ny,nz> plane through x,y,z with normal nx,ny,nz to slice.p.%%d.png\n"
+				"\t-P <x|y>            colour averaged along the x or y axis to project.x.png or project.y.png\n"
+				"\n",
+				argv[0], argv[0], size, threads);
+			exit(255);
+		} else if(strcmp(ptr, "-d") == 0 || strcmp(ptr, "--dir") == 0) {
+			ptr = argv[++i];
+			if(ptr == NULL) { printf("Please specify output directory\n"); exit(1); }
+			if(chdir(ptr) == -1)  { printf("Couldn't switch directories to %s\n", ptr); exit(2); }
+		} else if(strcmp(ptr, "-s") == 0 || strcmp(ptr, "--size") == 0) {
+			ptr = argv[++i];
+			if(ptr == NULL) { printf("Please specify the Size\n"); exit(1); }
+			size = atoi(ptr);
+			if(size < 1){ printf("Size out of range\n"); exit(2); }
+		} else if(strcmp(ptr, "-H") == 0 || strcmp(ptr, "--height") == 0) {
+			ptr = argv[++i];
+			if(ptr == NULL) { printf("Please specify the Height\n"); exit(1); }
+			height = atoi(ptr);
+			if(height < 1){ printf("Height out of range\n"); exit(2); }
+		} else if(strcmp(ptr, "-t") == 0 || strcmp(ptr, "--threads") == 0) {
+			ptr = argv[++i];
+			if(ptr == NULL) { printf("Please specify the thread count\n"); exit(1); }
+			threads = atoi(ptr);
+			if(threads < 1 || threads > MAX_THREADS){ printf("Thread count out of range, max: %d\n", MAX_THREADS); exit(2); }
+		} else if(strcmp(ptr, "-r") == 0 || strcmp(ptr, "--raw") == 0) {
+			raw = true;
+		} else if(strcmp(ptr, "--randcolor") == 0) {
+			randcolor = true;
+		} else if(strcmp(ptr, "-x") == 0 || strcmp(ptr, "-y") == 0 || strcmp(ptr, "-o") == 0 || strcmp(ptr, "-p") == 0) {
+			Spec spec;
+			spec.type = ptr[1];
+			ptr = argv[++i];
+			if(ptr == NULL) { printf("Please specify the slice location\n"); exit(1); }
+			int num = sscanf(ptr, "%lf,%lf,%lf,%lf,%lf,%lf", &spec.a[0], &spec.a[1], &spec.a[2], &spec.a[3], &spec.a[4], &spec.a[5]);
+			int need = (spec.type == 'o' ? 3 : spec.type == 'p' ? 6 : 1);
+			if(num != need){ printf("Slice -%c needs %d comma separated values\n", spec.type, need); exit(1); }
+			specs.push_back(spec);
+		} else if(strcmp(ptr, "-P") == 0) {
+			Spec spec;
+			spec.type = 'P';
+			ptr = argv[++i];
+			if(ptr == NULL || (strcmp(ptr, "x") != 0 && strcmp(ptr, "y") != 0)) { printf("Please specify x or y\n"); exit(1); }
+			spec.a[0] = (ptr[0] == 'y');
+			specs.push_back(spec);
+		} else {
+			printf("Unknown argument %s\n", ptr);
+			exit(1);
+		}
+	}
+
+	if(specs.empty()){
+		printf("No slices requested\n");
+		exit(1);
+	}
+
+	//only go up to the first missing layer
+	int layers = 0;
+	for(; layers < height; layers++){
+		char filename[50];
+		sprintf(filename, "data.%05d.dat", layers);
+		if(access(filename, R_OK) != 0)
+			break;
+	}
+
+	if(layers == 0){
+		printf("No data.%%05d.dat files found\n");
+		exit(1);
+	}
+
+	vector<RGB> colors = grain_colors(randcolor);
+
+	vector<Slice *> slices;
+	for(unsigned int i = 0; i < specs.size(); i++){
+		Spec & s = specs[i];
+		char name[50];
+		switch(s.type){
+			case 'x':
+				sprintf(name, "slice.x.%05d", (int)s.a[0]);
+				slices.push_back(new VerticalSlice(size, layers, s.a[0], 0, 90, name));
+				break;
+			case 'y':
+				sprintf(name, "slice.y.%05d", (int)s.a[0]);
+				slices.push_back(new VerticalSlice(size, layers, 0, s.a[0], 0, name));
+				break;
+			case 'o':
+				sprintf(name, "slice.o.%d", i);
+				slices.push_back(new VerticalSlice(size, layers, s.a[0], s.a[1], s.a[2], name));
+				break;
+			case 'p':
+				sprintf(name, "slice.p.%d", i);
+				slices.push_back(new PlaneSlice(size, layers, Coord3f(s.a[0], s.a[1], s.a[2]), Coord3f(s.a[3], s.a[4], s.a[5]), name));
+				break;
+			case 'P':
+				slices.push_back(new Projection(size, layers, (int)s.a[0], colors));
+				break;
+		}
+	}
+
+	printf("Rendering %d slices from %d layers ... ", (int)slices.size(), layers);
+	fflush(stdout);
+
+	Worker worker(threads);
+
+	for(int z = 0; z < layers; z++)
+		worker.add(new LayerReq(z, size, &slices));
+	worker.wait();
+
+	for(unsigned int i = 0; i < slices.size(); i++){
+		slices[i]->save(colors, raw);
+		delete slices[i];
+	}
+
+	printf("done\n");
+
+	return 0;
+}
+
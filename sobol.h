@@ -0,0 +1,45 @@
+
+#ifndef _SOBOL_H_
+#define _SOBOL_H_
+
+#include <stdint.h>
+
+//the first 4 dimensions of the Sobol low discrepancy sequence, direction numbers from Joe and Kuo.
+//get() computes point i directly so separate threads can each take a range of the sequence
+class Sobol {
+	uint32_t v[4][32];
+
+public:
+	Sobol(){
+		static const int s[4] = { 0, 1, 2, 3 };  //degree of the primitive polynomial
+		static const int a[4] = { 0, 0, 1, 1 };  //its inner coefficients
+		static const uint32_t m[4][3] = { { 0 }, { 1 }, { 1, 3 }, { 1, 3, 1 } };
+
+		for(int k = 0; k < 32; k++)
+			v[0][k] = 1u << (31 - k);
+
+		for(int d = 1; d < 4; d++){
+			for(int k = 0; k < s[d]; k++)
+				v[d][k] = m[d][k] << (31 - k);
+
+			for(int k = s[d]; k < 32; k++){
+				v[d][k] = v[d][k - s[d]] ^ (v[d][k - s[d]] >> s[d]);
+				for(int j = 1; j < s[d]; j++)
+					if((a[d] >> (s[d] - 1 - j)) & 1)
+						v[d][k] ^= v[d][k - j];
+			}
+		}
+	}
+
+	//coordinate d of point i, in [0,1)
+	double get(int d, uint32_t i) const {
+		uint32_t x = 0;
+		for(int k = 0; i; i >>= 1, k++)
+			if(i & 1)
+				x ^= v[d][k];
+		return x / 4294967296.0;
+	}
+};
+
+#endif
+
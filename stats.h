@@ -2,7 +2,6 @@
 #ifndef _STATS_H_
 #define _STATS_H_
 
-#include <pthread.h>
 #include "color.h"
 #include "worker.h"
 #include "coord.h"
@@ -24,28 +23,59 @@ struct Stats {
 		}
 	};
 
-	struct RayReq : WorkRequest {
-		Grid * grid;
-		const vector<Grain> & grains;
-		Ray ray;
-		Coord3f light;
-		int x, y;
-		gdImagePtr im;
-		pthread_mutex_t * lock;
+	struct PeaksReq : WorkRequest {
+		const Grid * grid;
+		int y1, y2;
+		vector<Coord3i> & peaks;
 
-		RayReq(Grid * _grid, const vector<Grain> & _grains, Ray r, Coord3f _light, int _x, int _y, gdImagePtr _im, pthread_mutex_t * _lock)
-			: grid(_grid), grains(_grains), ray(r), light(_light), x(_x), y(_y), im(_im), lock(_lock) { }
+		PeaksReq(const Grid * _grid, int _y1, int _y2, vector<Coord3i> & _peaks) : grid(_grid), y1(_y1), y2(_y2), peaks(_peaks) { }
 
 		int64_t run(){
-			RGB rgb = Stats::shootray(ray, light, grid, grains);
+			find_peaks(grid, y1, y2, peaks);
+			return 0;
+		}
+	};
+
+	//where the view is from, loc is the eye with perspective or the centre of the image plane without
+	struct Camera {
+		Coord3f loc, dir, shiftx, shifty; //shiftx, shifty are one pixel across the image plane
+		double focal; //distance from the eye to the image plane, 0 for orthographic
+		int width, height;
+
+		Ray ray(int x, int y) const {
+			Coord3f offset = shiftx * (x - width/2) + shifty * (y - height/2);
+			if(focal > 0){
+				Coord3f d = dir * focal + offset;
+				return Ray(loc, d.scale());
+			}
+			return Ray(loc + offset, dir);
+		}
+	};
 
-			pthread_mutex_lock(lock);
+	typedef RGB (*Shader)(Ray, Coord3f, Grid *, const vector<Grain> &, int);
 
-			int color = gdImageColorAllocate(im, rgb.r, rgb.g, rgb.b);
-			gdImageSetPixel(im, x, y, color);
+	//render one tile of an image into its own part of the framebuffer, so no locking is needed
+	struct RenderTileReq : WorkRequest {
+		Grid * grid;
+		const vector<Grain> & grains;
+		const Camera & cam;
+		Shader shade;
+		Coord3f light;
+		int x1, y1, x2, y2, top;
+		int * fb;
 
-			pthread_mutex_unlock(lock);
+		RenderTileReq(Grid * _grid, const vector<Grain> & _grains, const Camera & _cam, Shader _shade, Coord3f _light,
+			int _x1, int _y1, int _x2, int _y2, int _top, int * _fb)
+			: grid(_grid), grains(_grains), cam(_cam), shade(_shade), light(_light),
+			  x1(_x1), y1(_y1), x2(_x2), y2(_y2), top(_top), fb(_fb) { }
 
+		int64_t run(){
+			for(int y = y1; y < y2; y++){
+				for(int x = x1; x < x2; x++){
+					RGB rgb = shade(cam.ray(x, y), light, grid, grains, top);
+					fb[y*cam.width + x] = gdTrueColor(rgb.r, rgb.g, rgb.b);
+				}
+			}
 			return 0;
 		}
 	};
@@ -61,8 +91,6 @@ struct Stats {
 			worker->add(new TimeStatsReq(timemap,    t, grid, grains));
 		if(opts.fluxdump)
 			worker->add(new TimeStatsReq(fluxdump,   t, grid, grains));
-		if(opts.peaks)
-			worker->add(new TimeStatsReq(peaks,      t, grid, grains));
 		if(opts.growth)
 			worker->add(new TimeStatsReq(growth,     t, grid, grains));
 		if(opts.timestats)
@@ -70,8 +98,12 @@ struct Stats {
 
 		worker->wait();	
 
+		if(opts.peaks)
+			peaks(worker, t, grid, grains);
 		if(opts.isomorphic)
 			isomorphic(worker, t, grid, grains);
+		if(opts.surf3d)
+			surf3d(worker, t, grid, grains);
 	}
 
 	static void growth(int t, Grid * grid, const vector<Grain> & grains) {
@@ -91,20 +123,20 @@ struct Stats {
 		fclose(fd);
 	}
 
-	static void peaks(int t, Grid * grid, const vector<Grain> & grains) {
-		vector<Coord3i> peaks(grains.size());
-
-		for(int y = 0; y < FIELD; y++){
+	//the highest point of each grain in rows y1 to y2 that no other grain touches at the same height, wrapping
+	//periodically. Grains without one are left at z = 0, and the first in row order wins a tie
+	static void find_peaks(const Grid * grid, int y1, int y2, vector<Coord3i> & peaks){
+		for(int y = y1; y < y2; y++){
 			for(int x = 0; x < FIELD; x++){
 				int z = grid->heights[y][x];
 				int grain = grid->get_grain(x, y, z);
 				if(grain && grain < MAXGRAIN && peaks[grain].z < z){
 					bool peak = true;
-					for(int x1 = -1; x1 <= 1; x1++){
-						for(int y1 = -1; y1 <= 1; y1++){
-							if(x1 == x && y1 == y)
+					for(int dy = -1; dy <= 1 && peak; dy++){
+						for(int dx = -1; dx <= 1 && peak; dx++){
+							if(dx == 0 && dy == 0)
 								continue;
-							int g = grid->get_grain(x - x1, y - y1, z);
+							int g = grid->get_grain(x + dx, y + dy, z);
 							if(g != 0 && g != grain && g < MAXGRAIN)
 								peak = false;
 						}
@@ -114,6 +146,28 @@ struct Stats {
 				}
 			}
 		}
+	}
+
+	//the peaks of the whole field, each band of rows found on its own then merged in row order
+	static void find_peaks(Worker * worker, const Grid * grid, int num_grains, vector<Coord3i> & peaks){
+		const int num_bands = 16;
+		vector<Coord3i> bands[num_bands];
+		for(int b = 0; b < num_bands; b++){
+			bands[b].resize(num_grains);
+			worker->add(new PeaksReq(grid, FIELD * b / num_bands, FIELD * (b + 1) / num_bands, bands[b]));
+		}
+		worker->wait();
+
+		peaks.assign(num_grains, Coord3i());
+		for(int b = 0; b < num_bands; b++)
+			for(int i = 0; i < num_grains; i++)
+				if(peaks[i].z < bands[b][i].z)
+					peaks[i] = bands[b][i];
+	}
+
+	//the peaks Growth::step found this step
+	static void peaks(Worker * worker, int t, Grid * grid, const vector<Grain> & grains) {
+		const vector<Coord3i> & peaks = grid->peaks;
 
 		char filename[50];
 		sprintf(filename, "peaks.%05d.csv", t);
@@ -133,7 +187,7 @@ struct Stats {
 - rms roughness = sqrt(sum((h - avgH)^2)/FIELD^2)
 */
 
-		int num = grid->graincount(grains.size());
+		int num = grid->graincount();
 		double mean = grid->mean_height();
 
 		double totalms = 0;
@@ -143,6 +197,9 @@ struct Stats {
 
 		double rms = sqrt(totalms/(FIELD*FIELD));
 
+		if(grid->slabs && grid->slabs->rank) //every slab counts the grains, the first writes them
+			return;
+
 		FILE * fd = fopen("timestats.csv", "a");
 		fprintf(fd, "%d,%d,%f,%f\n", t, num, mean, rms);
 		fclose(fd);
@@ -279,52 +336,197 @@ struct Stats {
 		gdImageDestroy(im);
 	}
 
-	static void isomorphic(Worker * worker, int t, Grid * grid, const vector<Grain> & grains) {
-		const double scale = 1.0;
-		const int width = scale*FIELD*1.5;
-		const int height= scale*FIELD;
-		int dist = FIELD*0.7;
-
-		Ray init;
-		init.dir = Coord3f(1, 1, -1).scale();
-		init.loc = Coord3f(FIELD/2, FIELD/2, grid->mean_height()) - init.dir * dist;
-
-		Coord3f light = Coord3f(1, -1, -1).scale();
-
+	//the tallest column, nothing above it can be hit
+	static int top_height(Grid * grid){
+		int top = 0;
+		for(int y = 0; y < FIELD; y++)
+			for(int x = 0; x < FIELD; x++)
+				if(top < grid->heights[y][x])
+					top = grid->heights[y][x];
+		return top;
+	}
 
-		gdImagePtr im = gdImageCreateTrueColor(width, height);
-		gdImageFill(im, 0, 0, gdImageColorAllocate(im, 0, 0, 0));
+	static Camera view(Grid * grid, double scale){
+		Camera cam;
+		cam.width  = scale*FIELD*1.5;
+		cam.height = scale*FIELD;
+		cam.focal  = 0;
 
-		Coord3f shiftx = Coord3f(0, 0, 1).cross(init.dir);
-		Coord3f shifty = shiftx.cross(init.dir);
+		cam.dir = Coord3f(1, 1, -1).scale();
+		cam.loc = Coord3f(FIELD/2, FIELD/2, grid->mean_height());
 
-		shiftx.scale(1/scale);
-		shifty.scale(1/scale);
+		cam.shiftx = Coord3f(0, 0, 1).cross(cam.dir);
+		cam.shifty = cam.shiftx.cross(cam.dir);
 
-		pthread_mutex_t lock;
-		pthread_mutex_init(&lock, NULL);
+		cam.shiftx.scale(1/scale);
+		cam.shifty.scale(1/scale);
+		return cam;
+	}
 
-		for(int y = 0; y < height; y++){
-			for(int x = 0; x < width; x++){
-				Ray ray = init;
+	static void render(Worker * worker, const char * filename, const Camera & cam, Shader shade, Coord3f light, Grid * grid, const vector<Grain> & grains) {
+		const int tile = 64;
+		int top = top_height(grid);
 
-				ray.loc += shiftx * (x - width/2) + shifty * (y - height/2);
+		int * fb = new int[cam.width*cam.height];
 
-//				shootray(ray, light, grid, grains);
-				worker->add(new RayReq(grid, grains, ray, light, x, y, im, &lock));
-			}
-		}
+		for(int y = 0; y < cam.height; y += tile)
+			for(int x = 0; x < cam.width; x += tile)
+				worker->add(new RenderTileReq(grid, grains, cam, shade, light,
+					x, y, min(x + tile, cam.width), min(y + tile, cam.height), top, fb));
 		worker->wait();
 
-		char filename[50];
-		sprintf(filename, "isomorphic.%05d.png", t);
+		gdImagePtr im = gdImageCreateTrueColor(cam.width, cam.height);
+		for(int y = 0; y < cam.height; y++)
+			for(int x = 0; x < cam.width; x++)
+				gdImageSetPixel(im, x, y, fb[y*cam.width + x]);
+		delete[] fb;
+
 		FILE * fd = fopen(filename, "wb");
 		gdImagePng(im, fd);
 		fclose(fd);
 		gdImageDestroy(im);
 	}
 
-	static RGB shootray(Ray ray, Coord3f light, Grid * grid, const vector<Grain> & grains){
+	//trace the voxels, needs the planes the rays pass through
+	static void isomorphic(Worker * worker, int t, Grid * grid, const vector<Grain> & grains) {
+		int dist = FIELD*0.7;
+
+		Camera cam = view(grid, 1.0);
+		cam.loc -= cam.dir * dist;
+
+		char filename[50];
+		sprintf(filename, "isomorphic.%05d.png", t);
+		render(worker, filename, cam, shootray, Coord3f(1, -1, -1).scale(), grid, grains);
+	}
+
+	//trace the height field, only needs the heights and the top point of each column
+	static void surf3d(Worker * worker, int t, Grid * grid, const vector<Grain> & grains) {
+		Camera cam = view(grid, 1.0);
+		if(opts.perspective){
+			cam.focal = FIELD*1.5; //a pixel is one unit wide at the centre of the field
+			cam.loc -= cam.dir * cam.focal;
+		}else{
+			cam.loc -= cam.dir * (FIELD*2 + top_height(grid)); //far enough back to be outside the field
+		}
+
+		char filename[50];
+		sprintf(filename, "surf3d.%05d.png", t);
+		render(worker, filename, cam, surfray, Coord3f(1, -1, -1).scale(), grid, grains);
+	}
+
+	//walk the columns under the ray until it drops below the top of one.
+	//side is which face was hit: 0 for the top, 1 for a wall facing x, 2 for a wall facing y
+	static bool trace_heights(Grid * grid, const Ray & ray, int top, Coord3i & hit, Coord3f & point, int & side){
+		double lo[3] = { 0, 0, 0 };
+		double hi[3] = { FIELD, FIELD, top + 1.0 };
+		double o[3]  = { ray.loc.x, ray.loc.y, ray.loc.z };
+		double d[3]  = { ray.dir.x, ray.dir.y, ray.dir.z };
+
+	//clip the ray to the box holding the field
+		double t = 0, tend = 1e30;
+		side = 0;
+		for(int i = 0; i < 3; i++){
+			if(d[i] == 0){
+				if(o[i] < lo[i] || o[i] > hi[i])
+					return false;
+				continue;
+			}
+			double ta = (lo[i] - o[i]) / d[i];
+			double tb = (hi[i] - o[i]) / d[i];
+			if(ta > tb) swap(ta, tb);
+			if(ta > t){
+				t = ta;
+				side = (i + 1) % 3; //x -> 1, y -> 2, z -> 0
+			}
+			tend = min(tend, tb);
+		}
+		if(t > tend)
+			return false;
+
+		int x = min(FIELD - 1, max(0, (int)(o[0] + d[0]*t)));
+		int y = min(FIELD - 1, max(0, (int)(o[1] + d[1]*t)));
+		int stepx = (d[0] > 0 ? 1 : -1);
+		int stepy = (d[1] > 0 ? 1 : -1);
+
+	//t at which the ray crosses into the next column along x and y
+		double tx = (d[0] == 0 ? 1e30 : ((d[0] > 0 ? x + 1 : x) - o[0]) / d[0]);
+		double ty = (d[1] == 0 ? 1e30 : ((d[1] > 0 ? y + 1 : y) - o[1]) / d[1]);
+		double dtx = (d[0] == 0 ? 1e30 : fabs(1 / d[0]));
+		double dty = (d[1] == 0 ? 1e30 : fabs(1 / d[1]));
+
+		while(t <= tend){
+			int h = grid->heights[y][x];
+			double ztop = (h ? h + 1 : 0);
+			double texit = min(tend, min(tx, ty));
+
+			if(o[2] + d[2]*t <= ztop){ //came in through the side, or straight onto the top of the field
+				hit = Coord3i(x, y, h);
+				point = ray.loc + ray.dir * t;
+				return true;
+			}
+			if(o[2] + d[2]*texit <= ztop){ //dropped onto the top of this column
+				hit = Coord3i(x, y, h);
+				point = ray.loc + ray.dir * ((ztop - o[2]) / d[2]);
+				side = 0;
+				return true;
+			}
+
+			if(tx < ty){
+				t = tx;
+				tx += dtx;
+				x += stepx;
+				side = 1;
+			}else{
+				t = ty;
+				ty += dty;
+				y += stepy;
+				side = 2;
+			}
+			if(x < 0 || x >= FIELD || y < 0 || y >= FIELD)
+				return false;
+		}
+		return false;
+	}
+
+	static RGB surfray(Ray ray, Coord3f light, Grid * grid, const vector<Grain> & grains, int top){
+		Coord3i c;
+		Coord3f point;
+		int side;
+
+		if(!trace_heights(grid, ray, top, c, point, side))
+			return RGB();
+
+		Point * p = grid->get_point(c.x, c.y, c.z);
+		if(p->grain == 0 || p->grain >= MAXGRAIN)
+			return RGB();
+
+	//the walls of the field are flat, elsewhere the walls of a column are just steps of the face on top
+		Coord3f vec;
+		if(side == 1 && (c.x == 0 || c.x == FIELD - 1))      vec = Coord3f(ray.dir.x > 0 ? -1 : 1, 0, 0);
+		else if(side == 2 && (c.y == 0 || c.y == FIELD - 1)) vec = Coord3f(0, ray.dir.y > 0 ? -1 : 1, 0);
+		else                                                 vec = grains[p->grain].faces[p->face].vec;
+
+		double dot = light.dot(vec);
+		double hue = grains[p->grain].color;
+
+	//in shadow if the way back to the light is blocked by another column. Faces turned away from
+	//the light are already dark. Start a bit higher so the steps of a sloped face don't shadow each other
+		double shade = 1.0;
+		Coord3i c2;
+		Coord3f p2;
+		int side2;
+		if(dot < 0 && trace_heights(grid, Ray(point + vec * 0.01 + Coord3f(0, 0, 1.5), -light), top, c2, p2, side2))
+			shade = 0.5;
+
+		if(dot < 0) return RGB(HSV(hue, 1.0 + dot, shade));
+		else        return RGB(HSV(hue, 1.0, (1.0 - dot)*shade));
+	}
+
+	static RGB shootray(Ray ray, Coord3f light, Grid * grid, const vector<Grain> & grains, int top){
+	//skip the steps that are all above the tallest column, keeping the same sample points
+		if(ray.dir.z < 0 && ray.loc.z > top + 1)
+			ray.loc += ray.dir * (int)((ray.loc.z - (top + 1)) / -ray.dir.z);
+
 		while(1){
 			ray.incr();
 			Coord3i c = ray.loc;
@@ -333,6 +535,9 @@ struct Stats {
 				return RGB();
 
 			if(c.x >= 0 && c.y >= 0 && c.z < grid->zmax){ //inside
+				if(c.z > grid->heights[c.y][c.x]) //above this column, no need to look at the plane
+					continue;
+
 				Point * p = grid->get_point(c.x, c.y, c.z);
 
 				if(p->grain != 0 && p->grain < MAXGRAIN){ //on the surface
@@ -0,0 +1,94 @@
+
+#ifndef _TEXTURE_H_
+#define _TEXTURE_H_
+
+#include "plugins.h"
+
+//Texture of the surface every timestep: the normal of each grain's face closest to the substrate normal, weighted
+//by the columns the grain is on top of. Taking the closest face folds in the symmetry of the shape, so a cube with
+//any of its faces up counts as untilted. The weights come from the counts Grid::set_point keeps, so a step costs a
+//pass over the grains, not the field. The normal is binned by its tilt from the substrate normal and its azimuth.
+//Writes the tilt histogram as fractions of the surface to texture.csv, and the pole figure to pole.%05d.csv
+class Texture : public Plugin {
+	static const int tilt_bins = 18;    //5 degrees each, 0 to 90
+	static const int azimuth_bins = 36; //10 degrees each, 0 to 360
+
+	vector<int> bins; //tilt_bin*azimuth_bins + azimuth_bin of each grain, found the first step
+
+	void find_bins(const vector<Grain> & grains){
+		bins.resize(grains.size(), 0);
+		for(unsigned int i = 1; i < grains.size(); i++){
+			Coord3f axis(0, 0, -1);
+			for(unsigned int f = 0; f < grains[i].faces.size(); f++){
+				Coord3f n = grains[i].faces[f].vec;
+				n.scale();
+				if(n.z > axis.z)
+					axis = n;
+			}
+
+			double tilt = acos(min(1.0, (double)axis.z)) * 180 / M_PI;
+			double azimuth = atan2(axis.y, axis.x) * 180 / M_PI;
+			if(azimuth < 0)
+				azimuth += 360;
+
+			int t = min(tilt_bins - 1, (int)(tilt * tilt_bins / 90));
+			int a = min(azimuth_bins - 1, (int)(azimuth * azimuth_bins / 360));
+			bins[i] = t*azimuth_bins + a;
+		}
+	}
+
+public:
+	Texture(){
+		FILE * fd = fopen("texture.csv", "w");
+		fprintf(fd, "time,surface grains,mean tilt");
+		for(int i = 0; i < tilt_bins; i++)
+			fprintf(fd, ",tilt %d+", i*90/tilt_bins);
+		fprintf(fd, "\n");
+		fclose(fd);
+	}
+
+	void step(Worker * worker, int t, const Grid * grid, const vector<Grain> & grains){
+		if(bins.size() != grains.size())
+			find_bins(grains);
+
+		vector<int64_t> pole(tilt_bins*azimuth_bins, 0);
+		int64_t total = 0;
+		int num = 0;
+		for(unsigned int i = 1; i < grains.size(); i++){
+			int n = grid->surface[i];
+			if(n){
+				pole[bins[i]] += n;
+				total += n;
+				num++;
+			}
+		}
+		if(!total)
+			return;
+
+		vector<double> tilt(tilt_bins, 0.0);
+		double mean = 0;
+		for(int b = 0; b < tilt_bins*azimuth_bins; b++){
+			tilt[b / azimuth_bins] += (double)pole[b] / total;
+			mean += (b / azimuth_bins + 0.5) * 90 / tilt_bins * pole[b] / total;
+		}
+
+		FILE * fd = fopen("texture.csv", "a");
+		fprintf(fd, "%d,%d,%f", t, num, mean);
+		for(int i = 0; i < tilt_bins; i++)
+			fprintf(fd, ",%f", tilt[i]);
+		fprintf(fd, "\n");
+		fclose(fd);
+
+		char filename[50];
+		sprintf(filename, "pole.%05d.csv", t);
+		fd = fopen(filename, "w");
+		fprintf(fd, "tilt,azimuth,fraction\n");
+		for(int b = 0; b < tilt_bins*azimuth_bins; b++)
+			if(pole[b])
+				fprintf(fd, "%d,%d,%f\n", (b / azimuth_bins)*90/tilt_bins, (b % azimuth_bins)*360/azimuth_bins, (double)pole[b] / total);
+		fclose(fd);
+	}
+};
+
+#endif
+
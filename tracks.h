@@ -0,0 +1,48 @@
+
+#ifndef _TRACKS_H_
+#define _TRACKS_H_
+
+#include "plugins.h"
+
+//How each grain's peak moves from one timestep to the next, the peaks Growth::step finds for the peaks output
+//compared against the last step's, or found here if it didn't. The moves wrap periodically, so they're never more
+//than half the field. A grain that had no peak last step starts a new track with no move. Written to tracks.csv
+class PeakTracks : public Plugin {
+	vector<Coord3i> last;
+
+	static int wrap(int d){
+		return ((d + FIELD/2) % FIELD + FIELD) % FIELD - FIELD/2;
+	}
+
+public:
+	PeakTracks(){
+		FILE * fd = fopen("tracks.csv", "w");
+		fprintf(fd, "time,grain,x,y,z,dx,dy,dz\n");
+		fclose(fd);
+	}
+
+	void step(Worker * worker, int t, const Grid * grid, const vector<Grain> & grains){
+		vector<Coord3i> found;
+		if(grid->peaks.size() != grains.size()) //added without --tracks or --peaks
+			Stats::find_peaks(worker, grid, grains.size(), found);
+		const vector<Coord3i> & peaks = (found.empty() ? grid->peaks : found);
+		last.resize(grains.size());
+
+		FILE * fd = fopen("tracks.csv", "a");
+		for(unsigned int i = 1; i < grains.size(); i++){
+			const Coord3i & p = peaks[i];
+			if(!p.z)
+				continue;
+			if(last[i].z)
+				fprintf(fd, "%d,%d,%d,%d,%d,%d,%d,%d\n", t, i, p.x, p.y, p.z, wrap(p.x - last[i].x), wrap(p.y - last[i].y), p.z - last[i].z);
+			else
+				fprintf(fd, "%d,%d,%d,%d,%d,0,0,0\n", t, i, p.x, p.y, p.z);
+		}
+		fclose(fd);
+
+		last = peaks;
+	}
+};
+
+#endif
+
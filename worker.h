@@ -3,50 +3,78 @@
 #define _WORKER_H_
 
 #include "tqueue.h"
+#include "nodes.h"
 
 struct WorkRequest {
 	virtual int64_t run() { return 0; }
 };
 
+//Runs requests on a pool of threads. Given Nodes, there is a queue per NUMA node and each thread is pinned to the
+//cores of one node and serves that node's queue, only taking from the others once its own runs dry.
 class Worker {
-	tqueue<WorkRequest> request;
+	tqueue<WorkRequest> * request; //one per node
 	tqueue<int64_t> response;
 	int num_threads;
 	pthread_t thread[MAX_THREADS];
 
+	struct ThreadArg {
+		Worker * w;
+		int queue;
+	} args[MAX_THREADS];
+
+	const Nodes * nodes;
+	int num_queues;
+	int next_queue; //for requests without a node
+
 	int req_count;
 	int res_count;
 
 	bool running;
 
 public:
-	Worker(int num){
+	Worker(int num, const Nodes * n = NULL){
 		num_threads = num;
 		running = true;
 
 		req_count = 0;
 		res_count = 0;
 
-		if(num_threads > 1)
-			for(int i = 0; i < num_threads; i++)
-				pthread_create(&(thread[i]), NULL, (void* (*)(void*)) threadRunner, this);
+		nodes = n;
+		num_queues = (nodes && num_threads > 1 ? min(nodes->num(), num_threads) : 1);
+		next_queue = 0;
+		request = new tqueue<WorkRequest>[num_queues];
+
+		if(num_threads > 1){
+			for(int i = 0; i < num_threads; i++){
+				args[i].w = this;
+				args[i].queue = i * num_queues / num_threads; //every queue gets at least one thread
+				pthread_create(&(thread[i]), NULL, (void* (*)(void*)) threadRunner, &args[i]);
+			}
+		}
 	}
 
 	~Worker(){
 		running = false;
-		request.nonblock();
+		for(int q = 0; q < num_queues; q++)
+			request[q].nonblock();
 
 		if(num_threads > 1)
 			for(int i = 0; i < num_threads; i++)
 				pthread_join(thread[i], NULL);
+
+		delete[] request;
 	}
 
 	static void * threadRunner(void * blah){
-		Worker * w = (Worker *) blah;
+		ThreadArg * arg = (ThreadArg *) blah;
+		Worker * w = arg->w;
 		WorkRequest * req;
 		int64_t * ret;
 
-		while(w->running && (req = w->request.pop())){
+		if(w->nodes)
+			w->nodes->pin(arg->queue);
+
+		while(w->running && (req = w->pop(arg->queue))){
 			ret = new int64_t;
 
 			*ret = req->run();
@@ -58,9 +86,24 @@ public:
 		return NULL;
 	}
 
-	void add(WorkRequest * req){
+	//next request for a thread serving queue q, its own first, then any other's, then wait for its own
+	WorkRequest * pop(int q){
+		for(int i = 0; i < num_queues; i++){
+			WorkRequest * req = request[(q + i) % num_queues].pop(0);
+			if(req)
+				return req;
+		}
+		return request[q].pop();
+	}
+
+	//queue a request, to be run on node if one is given, otherwise on any
+	void add(WorkRequest * req, int node = -1){
+		if(node < 0){
+			node = next_queue;
+			next_queue = (next_queue + 1) % num_queues;
+		}
 		req_count++;
-		request.push(req);
+		request[node % num_queues].push(req);
 	}
 
 	int64_t wait(){
@@ -75,7 +118,7 @@ public:
 			}
 		}else{
 			WorkRequest * req;
-			while((req = request.pop(0))){
+			while((req = request[0].pop(0))){
 				ret += req->run();
 				delete req;
 				res_count++;